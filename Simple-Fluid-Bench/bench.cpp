@@ -0,0 +1,257 @@
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <math.h>
+#include <stdlib.h>
+#include "../Simple-Fluid/scene/scene.hpp"
+
+// Times every stage of a step, for the four scenes at a range of resolutions,
+// and writes one CSV line per scene, resolution and stage.
+//
+// The steps are the ones the viewer and the headless runner take, simulate()
+// on a Scene, and the stages their profiler stages: sources (obstacles, dye
+// and heat), integrate, solve (with the warm start and the omega tuner when
+// the scene has them on), extrapolate and the advection. Stages a step does
+// not run are left out, so with --fused advect replaces advectVel and
+// advectSmoke.
+//
+// ns_per_cell is per step over the interior cells. gb_per_s is the traffic the
+// stage has to cause at the least, each array it streams read or written once
+// per cell, over its time; for the pressure solve that is per sweep, so it is
+// left empty for the multigrid and PCG solvers. Every case runs repeats times
+// a batch of steps sized to the grid; mean, standard deviation and minimum are
+// over the batches.
+//
+// --samplers times the bilinear sampling on its own: the sampler as it was,
+// with the field and its offsets picked at run time on every call, against
+// Fluid::sampleField and the sample<Field> templates it now dispatches to,
+// and counts the samples on which they differ.
+
+#define WARMUP_STEPS 5
+#define WORK_PER_BATCH 5e7	// cells * solver iterations per batch, sets the number of steps
+#define SAMPLES_PER_BATCH 4000000
+
+// bytes per interior cell of the simulation stages, the solve per sweep:
+// nbMask, nbInvCount, u, v and p read and written. Sources only touch the
+// cells under the obstacles and sources and have none.
+const double stageBytes[PROFILE_COLORIZE] = { 0, 3 * 4, 1 + 4 + 3 * 2 * 4, 0, 3 * 4 + 2 * 4, 4 * 4 + 4, 4 * 4 + 3 * 4 };
+
+std::vector<int> parseList(const char* arg) {
+	std::vector<int> list;
+	std::stringstream stream(arg);
+	std::string item;
+	while (std::getline(stream, item, ','))
+		list.push_back(atoi(item.c_str()));
+	return list;
+}
+
+void printUsage() {
+	std::cout << "usage: Simple-Fluid-Bench [--scenes 0,1,2,3] [--res 100,200,500,1000,2000] [--repeats 5] [--solver 0] [--threads 0] [--fused] [--samplers]" << std::endl;
+}
+
+// Fluid::sampleField before the templates: the array and the staggering
+// offsets come out of a switch, and the offsets are subtracted even when 0
+float sampleFieldRuntime(Fluid& f, float x, float y, int field) {
+	auto n = f.numY;
+	auto h = f.h;
+	auto h1 = 1.0f / h;
+	auto h2 = 0.5f * h;
+
+	x = std::max(std::min(x, f.numX * h), h);
+	y = std::max(std::min(y, f.numY * h), h);
+
+	auto dx = 0.0f;
+	auto dy = 0.0f;
+
+	float* p = nullptr;
+
+	switch (field) {
+		case U_FIELD: p = &f.u[0]; dy = h2; break;
+		case V_FIELD: p = &f.v[0]; dx = h2; break;
+		case S_FIELD: p = &f.m[0]; dx = h2; dy = h2; break;
+		default: break;
+	}
+
+	auto x0 = std::min((int)floorf((x - dx) * h1), f.numX - 1);
+	auto tx = ((x - dx) - x0 * h) * h1;
+	auto x1 = std::min(x0 + 1, f.numX - 1);
+
+	auto y0 = std::min((int)floorf((y - dy) * h1), f.numY - 1);
+	auto ty = ((y - dy) - y0 * h) * h1;
+	auto y1 = std::min(y0 + 1, f.numY - 1);
+
+	auto sx = 1.0f - tx;
+	auto sy = 1.0f - ty;
+
+	return sx * sy * p[x0 * n + y0] +
+		tx * sy * p[x1 * n + y0] +
+		tx * ty * p[x1 * n + y1] +
+		sx * ty * p[x0 * n + y1];
+}
+
+// points within a cell of every cell in storage order, as the advection
+// traces back, over the ghost ring too so the clamps are taken; cycling
+// through the three fields the way advectVel alternates between u and v
+int benchSamplers(const std::vector<int>& resolutions, int repeats) {
+	std::cout << "resolution,samples,repeats,ns_per_sample_runtime,ns_per_sample_switch,ns_per_sample_template,speedup,mismatches" << std::endl;
+	for (auto resolution : resolutions) {
+		Scene scene;
+		scene.resolution = resolution;
+		scene.numThreads = 1;
+		setupScene(scene, 1);
+		for (auto step = 0; step < WARMUP_STEPS; step++)
+			simulate(scene);
+		auto& f = *scene.fluid.get();
+
+		std::vector<float> xs(SAMPLES_PER_BATCH), ys(SAMPLES_PER_BATCH);
+		std::vector<int> fields(SAMPLES_PER_BATCH);
+		srand(1);
+		for (auto k = 0; k < SAMPLES_PER_BATCH; k++) {
+			auto c = k % f.numCells;
+			xs[k] = (c / f.numY + 2.0f * rand() / RAND_MAX - 1.0f) * f.h;
+			ys[k] = (c % f.numY + 2.0f * rand() / RAND_MAX - 1.0f) * f.h;
+			fields[k] = k % 3;
+		}
+
+		std::vector<float> byRuntime(SAMPLES_PER_BATCH), bySwitch(SAMPLES_PER_BATCH), byTemplate(SAMPLES_PER_BATCH);
+		auto bestRuntime = 1e30, bestSwitch = 1e30, bestTemplate = 1e30;
+		for (auto r = 0; r < repeats; r++) {
+			auto tr = std::chrono::steady_clock::now();
+			for (auto k = 0; k < SAMPLES_PER_BATCH; k++)
+				byRuntime[k] = sampleFieldRuntime(f, xs[k], ys[k], fields[k]);
+			auto t0 = std::chrono::steady_clock::now();
+			for (auto k = 0; k < SAMPLES_PER_BATCH; k++)
+				bySwitch[k] = f.sampleField(xs[k], ys[k], fields[k]);
+			auto t1 = std::chrono::steady_clock::now();
+			for (auto k = 0; k < SAMPLES_PER_BATCH; k += 3) {
+				byTemplate[k] = f.sample<U_FIELD>(&f.u[0], xs[k], ys[k]);
+				if (k + 1 < SAMPLES_PER_BATCH)
+					byTemplate[k + 1] = f.sample<V_FIELD>(&f.v[0], xs[k + 1], ys[k + 1]);
+				if (k + 2 < SAMPLES_PER_BATCH)
+					byTemplate[k + 2] = f.sample<S_FIELD>(&f.m[0], xs[k + 2], ys[k + 2]);
+			}
+			auto t2 = std::chrono::steady_clock::now();
+			bestRuntime = std::min(bestRuntime, std::chrono::duration<double>(t0 - tr).count());
+			bestSwitch = std::min(bestSwitch, std::chrono::duration<double>(t1 - t0).count());
+			bestTemplate = std::min(bestTemplate, std::chrono::duration<double>(t2 - t1).count());
+		}
+
+		auto mismatches = 0;
+		for (auto k = 0; k < SAMPLES_PER_BATCH; k++) {
+			if (byRuntime[k] != bySwitch[k] || byRuntime[k] != byTemplate[k])
+				mismatches++;
+		}
+		std::cout << resolution << "," << SAMPLES_PER_BATCH << "," << repeats << "," << bestRuntime * 1e9 / SAMPLES_PER_BATCH << "," <<
+			bestSwitch * 1e9 / SAMPLES_PER_BATCH << "," << bestTemplate * 1e9 / SAMPLES_PER_BATCH << "," <<
+			bestRuntime / bestTemplate << "," << mismatches << std::endl;
+	}
+	return 0;
+}
+
+int main(int argc, char* argv[]) {
+	std::vector<int> scenes = { 0, 1, 2, 3 };
+	std::vector<int> resolutions = { 100, 200, 500, 1000, 2000 };
+	auto repeats = 5;
+	auto solver = SOLVER_GAUSS_SEIDEL;
+	auto numThreads = 0;
+	auto fused = false;
+	auto samplers = false;
+
+	for (auto a = 1; a < argc; a++) {
+		std::string arg = argv[a];
+		if (arg == "--fused" || arg == "--samplers") {
+			fused = fused || arg == "--fused";
+			samplers = samplers || arg == "--samplers";
+			continue;
+		}
+		if (a + 1 >= argc) {
+			printUsage();
+			return 1;
+		}
+		if (arg == "--scenes")
+			scenes = parseList(argv[++a]);
+		else if (arg == "--res")
+			resolutions = parseList(argv[++a]);
+		else if (arg == "--repeats")
+			repeats = std::max(1, atoi(argv[++a]));
+		else if (arg == "--solver")
+			solver = atoi(argv[++a]);
+		else if (arg == "--threads")
+			numThreads = atoi(argv[++a]);
+		else {
+			printUsage();
+			return 1;
+		}
+	}
+
+	if (samplers)
+		return benchSamplers(resolutions, repeats);
+
+	std::cout << "scene,resolution,cells,solver,threads,simd,stage,iterations,steps,repeats,ns_per_cell_mean,ns_per_cell_stddev,ns_per_cell_min,gb_per_s" << std::endl;
+
+	for (auto resolution : resolutions) {
+		for (auto sceneNr : scenes) {
+			Scene scene;
+			scene.resolution = resolution;
+			scene.solver = solver;
+			scene.numThreads = numThreads;
+			scene.fusedAdvection = fused;
+			setupScene(scene, sceneNr);
+			// the paint scene has no fluid until the obstacle is first placed
+			if (sceneNr == 2)
+				setObstacle(scene, 0.5f / SIM_HEIGHT * SIM_WIDTH, 0.5f, true);
+			for (auto step = 0; step < WARMUP_STEPS; step++)
+				simulate(scene);
+
+			// the stages are timed by the profiler of the scene, from here on
+			Profiler profiler;
+			scene.profiler = &profiler;
+			auto& f = *scene.fluid.get();
+			auto numCells = (double)(f.numX - 2) * (f.numY - 2);
+			auto numSteps = std::max(1, (int)(WORK_PER_BATCH / (numCells * scene.numIters)));
+
+			std::vector<std::vector<double>> nsPerCell(PROFILE_COLORIZE);
+			auto sumIters = 0.0;
+			for (auto r = 0; r < repeats; r++) {
+				double startMs[PROFILE_COLORIZE];
+				for (auto stage = 0; stage < PROFILE_COLORIZE; stage++)
+					startMs[stage] = profiler.total(stage);
+				for (auto step = 0; step < numSteps; step++) {
+					simulate(scene);
+					sumIters += f.solveStats.iterations;
+				}
+				for (auto stage = 0; stage < PROFILE_COLORIZE; stage++)
+					nsPerCell[stage].push_back((profiler.total(stage) - startMs[stage]) * 1e6 / numSteps / numCells);
+			}
+			auto iterations = sumIters / (repeats * numSteps);
+
+			for (auto stage = 0; stage < PROFILE_COLORIZE; stage++) {
+				if (profiler.stages[stage].count() == 0)
+					continue;
+				auto& samples = nsPerCell[stage];
+				auto mean = 0.0;
+				for (auto x : samples) mean += x;
+				mean /= samples.size();
+				auto var = 0.0;
+				for (auto x : samples) var += (x - mean) * (x - mean);
+				var = samples.size() > 1 ? var / (samples.size() - 1) : 0.0;
+				auto best = *std::min_element(samples.begin(), samples.end());
+
+				auto bytes = stageBytes[stage];
+				if (stage == PROFILE_SOLVE)
+					bytes *= iterations;
+				std::string gbPerSec;
+				if (bytes > 0.0 && mean > 0.0 && !(stage == PROFILE_SOLVE && solver != SOLVER_GAUSS_SEIDEL && solver != SOLVER_RED_BLACK))
+					gbPerSec = std::to_string(bytes / mean);
+
+				std::cout << sceneNr << "," << resolution << "," << (long long)numCells << "," << solver << "," <<
+					f.pool->size() << "," << simdLevelName(f.simdLevel) << "," << Profiler::stageName(stage) << "," <<
+					(stage == PROFILE_SOLVE ? iterations : 0.0) << "," << numSteps << "," << repeats << "," <<
+					mean << "," << sqrt(var) << "," << best << "," << gbPerSec << std::endl;
+			}
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,169 @@
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <math.h>
+#include <stdlib.h>
+#include "../Simple-Fluid/scene/checkpoint.hpp"
+#include "../Simple-Fluid/scene/scene.hpp"
+
+// Runs a scene without window, GL context or renderer, as fast as it goes,
+// and reports the throughput. Only needs the fluid and scene headers, stb_image and mapped_file.
+
+void printUsage() {
+	std::cout << "usage: Simple-Fluid-Headless scene resolution [dt] [iterations] [steps] [solver] [threads] [trace] [--mask image] [--dye image] [--load file] [--save file] [--fused] [--compare-fused]" << std::endl;
+	std::cout << "  scene       0 tank, 1 vortex shedding, 2 paint, 3 vortex shedding (fine), 4 obstacle course, 5 hot plume" << std::endl;
+	std::cout << "  resolution  cells across the domain height" << std::endl;
+	std::cout << "  dt          time step, 0: scene default" << std::endl;
+	std::cout << "  iterations  solver iterations per step, 0: scene default" << std::endl;
+	std::cout << "  steps       number of steps to run (default 1000)" << std::endl;
+	std::cout << "  solver      0 Gauss-Seidel, 1 red-black, 2 multigrid, 3 PCG" << std::endl;
+	std::cout << "  threads     worker threads, 0: one per hardware thread" << std::endl;
+	std::cout << "  trace       file to write a Chrome trace (chrome://tracing, Perfetto) of the run to" << std::endl;
+	std::cout << "  --mask      PNG/BMP laid over the domain, dark pixels are solid" << std::endl;
+	std::cout << "  --dye       PNG/BMP laid over the domain, opaque pixels keep the smoke at their brightness" << std::endl;
+	std::cout << "  --load      checkpoint to continue from, replaces the scene set up from the arguments" << std::endl;
+	std::cout << "  --save      checkpoint to write after the last step" << std::endl;
+	std::cout << "  --fused     advect velocity and smoke in one pass" << std::endl;
+	std::cout << "  --compare-fused  run the steps again with the other advection and print how far the fields end up apart" << std::endl;
+}
+
+// largest and RMS difference of two fields, over every cell
+void printDifference(const char* name, const std::vector<float>& a, const std::vector<float>& b) {
+	auto maxDiff = 0.0;
+	auto sumSq = 0.0;
+	for (size_t c = 0; c < a.size(); c++) {
+		auto d = fabs((double)a[c] - b[c]);
+		maxDiff = std::max(maxDiff, d);
+		sumSq += d * d;
+	}
+	std::cout << "  " << name << ": max " << maxDiff << ",   rms " << (a.empty() ? 0.0 : sqrt(sumSq / a.size())) << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+	std::vector<std::string> args;
+	auto fused = false;
+	auto compareFused = false;
+	std::string maskPath, dyePath, loadPath, savePath;
+	for (auto a = 1; a < argc; a++) {
+		std::string arg = argv[a];
+		if (arg == "--mask" && a + 1 < argc)
+			maskPath = argv[++a];
+		else if (arg == "--dye" && a + 1 < argc)
+			dyePath = argv[++a];
+		else if (arg == "--fused")
+			fused = true;
+		else if (arg == "--compare-fused")
+			compareFused = true;
+		else if (arg == "--load" && a + 1 < argc)
+			loadPath = argv[++a];
+		else if (arg == "--save" && a + 1 < argc)
+			savePath = argv[++a];
+		else
+			args.push_back(arg);
+	}
+	if (args.size() < 2) {
+		printUsage();
+		return 1;
+	}
+
+	auto numArgs = args.size();
+	auto sceneNr = atoi(args[0].c_str());
+	auto resolution = atoi(args[1].c_str());
+	auto dt = numArgs > 2 ? (float)atof(args[2].c_str()) : 0.0f;
+	auto numIters = numArgs > 3 ? atoi(args[3].c_str()) : 0;
+	auto numSteps = numArgs > 4 ? atoi(args[4].c_str()) : 1000;
+	auto solver = numArgs > 5 ? atoi(args[5].c_str()) : SOLVER_GAUSS_SEIDEL;
+	auto numThreads = numArgs > 6 ? atoi(args[6].c_str()) : 0;
+	std::string tracePath = numArgs > 7 ? args[7] : "";
+
+	if (sceneNr < 0 || sceneNr > 5 || resolution <= 0 || dt < 0.0f || numIters < 0 || numSteps <= 0 ||
+		solver < SOLVER_GAUSS_SEIDEL || solver > SOLVER_PCG || numThreads < 0) {
+		printUsage();
+		return 1;
+	}
+
+	// the scene as the arguments ask for it, with the given advection
+	auto prepare = [&](Scene& scene, bool fusedAdvection) {
+		scene.resolution = resolution;
+		scene.solver = solver;
+		scene.numThreads = numThreads;
+		scene.maskPath = maskPath;
+		scene.dyePath = dyePath;
+		scene.fusedAdvection = fusedAdvection;
+		setupScene(scene, sceneNr);
+		if (!loadPath.empty()) {
+			auto start = std::chrono::steady_clock::now();
+			if (!loadCheckpoint(scene, loadPath)) {
+				std::cout << "could not load checkpoint " << loadPath << std::endl;
+				return false;
+			}
+			std::cout << "loaded " << loadPath << " at frame " << scene.frameNr << " in " <<
+				std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() * 1000.0 << "ms" << std::endl;
+		}
+		// the paint scene has no fluid until the obstacle is first placed
+		else if (sceneNr == 2)
+			setObstacle(scene, 0.5f / SIM_HEIGHT * SIM_WIDTH, 0.5f, true);
+		if (dt > 0.0f)
+			scene.dt = dt;
+		if (numIters > 0)
+			scene.numIters = numIters;
+		return true;
+	};
+
+	Profiler profiler;
+	Scene scene;
+	scene.profiler = &profiler;
+	if (!prepare(scene, fused))
+		return 1;
+	sceneNr = scene.sceneNr;
+
+	auto& f = *scene.fluid.get();
+	auto numCells = (long long)(f.numX - 2) * (f.numY - 2);
+	std::cout << "scene " << sceneNr << ",   grid " << f.numX - 2 << " x " << f.numY - 2 <<
+		",   dt " << scene.dt << ",   iterations " << scene.numIters << ",   steps " << numSteps <<
+		",   solver " << solver << ",   threads " << f.pool->size() << ",   simd " << simdLevelName(f.simdLevel) << std::endl;
+
+	if (!tracePath.empty())
+		profiler.startTrace();
+	auto sumIters = 0ll;
+	auto start = std::chrono::steady_clock::now();
+	for (auto step = 0; step < numSteps; step++) {
+		TraceScope trace(&profiler, "step");
+		simulate(scene);
+		sumIters += f.solveStats.iterations;
+	}
+	auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	std::cout << "time: " << seconds << "s,   " << seconds * 1000.0 / numSteps << "ms/step" << std::endl;
+	std::cout << "solver iterations: " << (double)sumIters / numSteps << "/step,   last residual: " << f.solveStats.residual << std::endl;
+	std::cout << "throughput: " << numCells * numSteps / seconds << " cells*steps/s" << std::endl;
+	std::cout << profiler.report();
+
+	// the fused pass moves the smoke with the velocity from before the step,
+	// the two passes with the advected one, so the runs drift apart
+	if (compareFused) {
+		Scene other;
+		if (!prepare(other, !fused))
+			return 1;
+		for (auto step = 0; step < numSteps; step++)
+			simulate(other);
+		auto& g = *other.fluid.get();
+		std::cout << (fused ? "fused against two passes:" : "two passes against fused:") << std::endl;
+		printDifference("u", f.u, g.u);
+		printDifference("v", f.v, g.v);
+		printDifference("p", f.p, g.p);
+		printDifference("smoke", f.m, g.m);
+		if (f.numChannels > 0)
+			printDifference("channels", f.channels, g.channels);
+	}
+	if (!savePath.empty() && !saveCheckpoint(scene, savePath)) {
+		std::cout << "could not write checkpoint to " << savePath << std::endl;
+		return 1;
+	}
+	if (!tracePath.empty() && !profiler.writeTrace(tracePath)) {
+		std::cout << "could not write trace to " << tracePath << std::endl;
+		return 1;
+	}
+	return 0;
+}
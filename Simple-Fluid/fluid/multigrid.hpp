@@ -0,0 +1,312 @@
+#pragma once
+#include <vector>
+#include <math.h>
+#include <algorithm>
+#include "../tool/thread_pool.h"
+
+// Geometric multigrid for the pressure projection.
+//
+// Every level uses the layout of the fluid grid (i * numY + j, one ghost ring).
+// Unknowns are the cells inside the ring with at least one open face; fluid
+// cells on the ring are held at zero (open boundary). The operator is
+//     (A x)_c = sum over the four faces of w_f * (x_c - x_nb)
+// which on the finest level is exactly the stencil of Fluid::projectCell.
+//
+// A coarse cell aggregates up to 2x2 fine cells (odd sizes leave a thinner last
+// row/column, the ring keeps its position). The solid mask is restricted as the
+// open length of every coarse face and w_f = open length / center distance, so
+// the coarse operators are finite volume discretizations of the same problem.
+
+// linear interpolation from the two nearest coarse centers, per fine row/column
+struct MultigridInterp
+{
+	int I0;
+	int I1;
+	float w0;
+	float w1;
+};
+
+struct MultigridLevel
+{
+	int numX;
+	int numY;
+	std::vector<float> cx;		// cell center position along x, in finest cells
+	std::vector<float> cy;
+	std::vector<float> s;		// 1 if the cell holds any fluid
+	std::vector<float> openX;	// open length of the face between (i - 1, j) and (i, j)
+	std::vector<float> openY;	// open length of the face between (i, j - 1) and (i, j)
+	std::vector<float> wx;
+	std::vector<float> wy;
+	std::vector<float> diag;	// 0 for cells that are not unknowns
+	std::vector<float> x;
+	std::vector<float> b;
+	std::vector<float> r;
+	std::vector<MultigridInterp> interpX;	// indexed by the columns of the next finer level
+	std::vector<MultigridInterp> interpY;
+
+	void resize(int numX, int numY) {
+		this->numX = numX;
+		this->numY = numY;
+		auto numCells = numX * numY;
+		this->cx.assign(numX, 0.0f);
+		this->cy.assign(numY, 0.0f);
+		this->s.assign(numCells, 0.0f);
+		this->openX.assign(numCells, 0.0f);
+		this->openY.assign(numCells, 0.0f);
+		this->wx.assign(numCells, 0.0f);
+		this->wy.assign(numCells, 0.0f);
+		this->diag.assign(numCells, 0.0f);
+		this->x.assign(numCells, 0.0f);
+		this->b.assign(numCells, 0.0f);
+		this->r.assign(numCells, 0.0f);
+	}
+
+	void updateWeights() {
+		auto n = this->numY;
+		for (auto i = 1; i < this->numX; i++) {
+			for (auto j = 1; j < this->numY; j++) {
+				this->wx[i * n + j] = this->openX[i * n + j] / (this->cx[i] - this->cx[i - 1]);
+				this->wy[i * n + j] = this->openY[i * n + j] / (this->cy[j] - this->cy[j - 1]);
+			}
+		}
+		for (auto i = 1; i < this->numX - 1; i++) {
+			for (auto j = 1; j < this->numY - 1; j++) {
+				this->diag[i * n + j] = this->s[i * n + j] == 0.0 ? 0.0f :
+					this->wx[i * n + j] + this->wx[(i + 1) * n + j] +
+					this->wy[i * n + j] + this->wy[i * n + j + 1];
+			}
+		}
+	}
+};
+
+struct Multigrid
+{
+	int preSmooth{2};
+	int postSmooth{2};
+	int coarseSmooth{40};
+	std::vector<MultigridLevel> levels;
+
+	void build(int numX, int numY, const std::vector<float>& s) {
+		if (this->levels.empty() || this->levels[0].numX != numX || this->levels[0].numY != numY)
+			this->allocate(numX, numY);
+
+		auto& fine = this->levels[0];
+		auto n = numY;
+		fine.s = s;
+		for (auto i = 1; i < numX; i++) {
+			for (auto j = 1; j < numY; j++) {
+				fine.openX[i * n + j] = s[(i - 1) * n + j] * s[i * n + j];
+				fine.openY[i * n + j] = s[i * n + j - 1] * s[i * n + j];
+			}
+		}
+		fine.updateWeights();
+
+		for (auto l = 1; l < (int)this->levels.size(); l++)
+			this->coarsen(this->levels[l - 1], this->levels[l]);
+	}
+
+	// one V-cycle on A x = b of the finest level, starting from x = 0
+	void cycle(ThreadPool& pool) {
+		for (auto& val : this->levels[0].x) val = 0.0f;
+		this->vcycle(pool, 0);
+	}
+
+	// red-black Gauss-Seidel
+	void smooth(ThreadPool& pool, MultigridLevel& lv, int numIters) {
+		auto n = lv.numY;
+		for (auto iter = 0; iter < numIters; iter++) {
+			for (auto color = 0; color < 2; color++) {
+				pool.parallelFor(1, lv.numX - 1, [&](int i0, int i1, int) {
+					for (auto i = i0; i < i1; i++) {
+						for (auto j = 1 + (i + 1 + color) % 2; j < lv.numY - 1; j += 2) {
+							auto d = lv.diag[i * n + j];
+							if (d == 0.0f)
+								continue;
+							lv.x[i * n + j] = (lv.b[i * n + j] +
+								lv.wx[i * n + j] * lv.x[(i - 1) * n + j] +
+								lv.wx[(i + 1) * n + j] * lv.x[(i + 1) * n + j] +
+								lv.wy[i * n + j] * lv.x[i * n + j - 1] +
+								lv.wy[i * n + j + 1] * lv.x[i * n + j + 1]) / d;
+						}
+					}
+				});
+			}
+		}
+	}
+
+	// r = b - A x, returns max |r|
+	float computeResidual(ThreadPool& pool, MultigridLevel& lv) {
+		auto n = lv.numY;
+		auto& maxR = this->maxResidual;
+		maxR.assign(pool.size(), 0.0f);
+		pool.parallelFor(1, lv.numX - 1, [&](int i0, int i1, int t) {
+			auto m = 0.0f;
+			for (auto i = i0; i < i1; i++) {
+				for (auto j = 1; j < lv.numY - 1; j++) {
+					auto d = lv.diag[i * n + j];
+					auto r = 0.0f;
+					if (d != 0.0f) {
+						r = lv.b[i * n + j] - d * lv.x[i * n + j] +
+							lv.wx[i * n + j] * lv.x[(i - 1) * n + j] +
+							lv.wx[(i + 1) * n + j] * lv.x[(i + 1) * n + j] +
+							lv.wy[i * n + j] * lv.x[i * n + j - 1] +
+							lv.wy[i * n + j + 1] * lv.x[i * n + j + 1];
+					}
+					lv.r[i * n + j] = r;
+					m = std::max(m, fabsf(r));
+				}
+			}
+			maxR[t] = m;
+		});
+		return *std::max_element(maxR.begin(), maxR.end());
+	}
+
+private:
+	static const int MIN_COARSE_CELLS = 4;
+
+	std::vector<float> maxResidual;	// per thread, kept so the cycles do not allocate
+
+	void allocate(int numX, int numY) {
+		this->levels.clear();
+		auto nx = numX - 2;
+		auto ny = numY - 2;
+		this->levels.emplace_back();
+		auto& fine = this->levels.back();
+		fine.resize(numX, numY);
+		for (auto i = 0; i < numX; i++) fine.cx[i] = (float)i;
+		for (auto j = 0; j < numY; j++) fine.cy[j] = (float)j;
+
+		while (std::min(nx, ny) > MIN_COARSE_CELLS) {
+			nx = (nx + 1) / 2;
+			ny = (ny + 1) / 2;
+			this->levels.emplace_back();
+			this->levels.back().resize(nx + 2, ny + 2);
+		}
+	}
+
+	// fine cells covered by coarse cell I, the ring maps onto the ring
+	static int childBegin(int I, int fineInner) { return I == 0 ? 0 : std::min(2 * I - 1, fineInner + 1); }
+	static int childEnd(int I, int fineInner) { return I == 0 ? 0 : std::min(2 * I, fineInner + 1); }
+
+	static void coarsenAxis(const std::vector<float>& fine, std::vector<float>& coarse, std::vector<MultigridInterp>& interp) {
+		auto fineInner = (int)fine.size() - 2;
+		auto coarseInner = (int)coarse.size() - 2;
+		for (auto I = 0; I < (int)coarse.size(); I++)
+			coarse[I] = 0.5f * (fine[childBegin(I, fineInner)] + fine[childEnd(I, fineInner)]);
+
+		interp.assign(fine.size(), MultigridInterp{0, 0, 0.0f, 0.0f});
+		for (auto i = 1; i <= fineInner; i++) {
+			auto I0 = (i + 1) / 2;
+			auto I1 = fine[i] < coarse[I0] ? I0 - 1 : I0 + 1;
+			I1 = std::min(I1, coarseInner + 1);
+			auto t = I1 == I0 ? 0.0f : (fine[i] - coarse[I0]) / (coarse[I1] - coarse[I0]);
+			interp[i] = MultigridInterp{I0, I1, 1.0f - t, t};
+		}
+	}
+
+	void coarsen(const MultigridLevel& fine, MultigridLevel& coarse) {
+		auto fnx = fine.numX - 2;
+		auto fny = fine.numY - 2;
+		auto fn = fine.numY;
+		auto cn = coarse.numY;
+
+		coarsenAxis(fine.cx, coarse.cx, coarse.interpX);
+		coarsenAxis(fine.cy, coarse.cy, coarse.interpY);
+
+		for (auto I = 0; I < coarse.numX; I++) {
+			for (auto J = 0; J < coarse.numY; J++) {
+				auto s = 0.0f;
+				for (auto fi = childBegin(I, fnx); fi <= childEnd(I, fnx); fi++)
+					for (auto fj = childBegin(J, fny); fj <= childEnd(J, fny); fj++)
+						s = std::max(s, fine.s[fi * fn + fj]);
+				coarse.s[I * cn + J] = s;
+
+				if (I == 0 || J == 0)
+					continue;
+				// the low face of a coarse cell is made of the low faces of its
+				// first row/column of children
+				auto openX = 0.0f;
+				for (auto fj = childBegin(J, fny); fj <= childEnd(J, fny); fj++)
+					openX += fine.openX[childBegin(I, fnx) * fn + fj];
+				auto openY = 0.0f;
+				for (auto fi = childBegin(I, fnx); fi <= childEnd(I, fnx); fi++)
+					openY += fine.openY[fi * fn + childBegin(J, fny)];
+				coarse.openX[I * cn + J] = openX;
+				coarse.openY[I * cn + J] = openY;
+			}
+		}
+		coarse.updateWeights();
+	}
+
+	static float interpWeight(const MultigridInterp& t, int I) {
+		return t.I0 == I ? t.w0 : (t.I1 == I ? t.w1 : 0.0f);
+	}
+
+	// transpose of the (unmasked) bilinear prolongation
+	void restrictResidual(ThreadPool& pool, const MultigridLevel& fine, MultigridLevel& coarse) {
+		auto fn = fine.numY;
+		auto cn = coarse.numY;
+
+		pool.parallelFor(1, coarse.numX - 1, [&](int I0, int I1, int) {
+			for (auto I = I0; I < I1; I++) {
+				for (auto J = 1; J < coarse.numY - 1; J++) {
+					auto b = 0.0f;
+					if (coarse.diag[I * cn + J] != 0.0f) {
+						for (auto fi = std::max(1, 2 * I - 2); fi <= std::min(2 * I + 1, fine.numX - 2); fi++) {
+							auto wi = interpWeight(coarse.interpX[fi], I);
+							if (wi == 0.0f)
+								continue;
+							for (auto fj = std::max(1, 2 * J - 2); fj <= std::min(2 * J + 1, fine.numY - 2); fj++)
+								b += wi * interpWeight(coarse.interpY[fj], J) * fine.r[fi * fn + fj];
+						}
+					}
+					coarse.b[I * cn + J] = b;
+					coarse.x[I * cn + J] = 0.0f;
+				}
+			}
+		});
+	}
+
+	// bilinear, renormalized over the coarse cells that hold fluid
+	void prolongate(ThreadPool& pool, const MultigridLevel& coarse, MultigridLevel& fine) {
+		auto fn = fine.numY;
+		auto cn = coarse.numY;
+
+		pool.parallelFor(1, fine.numX - 1, [&](int i0, int i1, int) {
+			for (auto i = i0; i < i1; i++) {
+				auto& tx = coarse.interpX[i];
+				for (auto j = 1; j < fine.numY - 1; j++) {
+					if (fine.diag[i * fn + j] == 0.0f)
+						continue;
+					auto& ty = coarse.interpY[j];
+					int ci[4] = { tx.I0 * cn + ty.I0, tx.I1 * cn + ty.I0, tx.I0 * cn + ty.I1, tx.I1 * cn + ty.I1 };
+					float w[4] = { tx.w0 * ty.w0, tx.w1 * ty.w0, tx.w0 * ty.w1, tx.w1 * ty.w1 };
+					auto sum = 0.0f;
+					auto wsum = 0.0f;
+					for (auto k = 0; k < 4; k++) {
+						if (coarse.s[ci[k]] == 0.0f)
+							continue;
+						sum += w[k] * coarse.x[ci[k]];
+						wsum += w[k];
+					}
+					if (wsum > 0.0f)
+						fine.x[i * fn + j] += sum / wsum;
+				}
+			}
+		});
+	}
+
+	void vcycle(ThreadPool& pool, int l) {
+		auto& lv = this->levels[l];
+		if (l == (int)this->levels.size() - 1) {
+			this->smooth(pool, lv, this->coarseSmooth);
+			return;
+		}
+		this->smooth(pool, lv, this->preSmooth);
+		this->computeResidual(pool, lv);
+		this->restrictResidual(pool, lv, this->levels[l + 1]);
+		this->vcycle(pool, l + 1);
+		this->prolongate(pool, this->levels[l + 1], lv);
+		this->smooth(pool, lv, this->postSmooth);
+	}
+};
@@ -0,0 +1,225 @@
+#pragma once
+#include <vector>
+#include <math.h>
+#include <algorithm>
+#include "../tool/thread_pool.h"
+
+// Matrix-free preconditioned conjugate gradient for the pressure projection.
+//
+// Same system as the multigrid solver: unknowns are fluid cells inside the ghost
+// ring with at least one open face, (A x)_c = sum over faces of w_f * (x_c - x_nb)
+// with w_f = s_c * s_nb, fluid ring cells held at zero. Off-diagonal entries only
+// couple two unknowns, open faces to the ring just add to the diagonal.
+//
+// The preconditioner is modified incomplete Cholesky, MIC(0), in the natural
+// i * numY + j order. Its triangular solves are inherently sequential; the
+// stencil product, the vector updates and the dot products run on the pool.
+struct PCG
+{
+	float tau{0.97f};	// 0: plain incomplete Cholesky, 1: fully modified
+	float sigma{0.25f};	// safety against tiny pivots
+
+	int numX{0};
+	int numY{0};
+	std::vector<float> diag;	// 0 for cells that are not unknowns
+	std::vector<float> plusX;	// coupling to the +x / +y neighbor, 0 unless both are unknowns
+	std::vector<float> plusY;
+	std::vector<float> precon;
+	std::vector<float> x;
+	std::vector<float> b;
+	std::vector<float> r;
+	std::vector<float> z;
+	std::vector<float> d;		// search direction
+	std::vector<float> q;		// A d
+
+	void build(int numX, int numY, const std::vector<float>& s) {
+		if (this->numX != numX || this->numY != numY) {
+			this->numX = numX;
+			this->numY = numY;
+			auto numCells = numX * numY;
+			for (auto vec : { &this->diag, &this->plusX, &this->plusY, &this->precon, &this->x, &this->b, &this->r, &this->z, &this->d, &this->q })
+				vec->assign(numCells, 0.0f);
+		}
+
+		auto n = numY;
+		for (auto i = 1; i < numX - 1; i++) {
+			for (auto j = 1; j < numY - 1; j++) {
+				this->diag[i * n + j] = s[i * n + j] == 0.0 ? 0.0f :
+					s[(i - 1) * n + j] + s[(i + 1) * n + j] + s[i * n + j - 1] + s[i * n + j + 1];
+			}
+		}
+
+		for (auto i = 1; i < numX - 1; i++) {
+			for (auto j = 1; j < numY - 1; j++) {
+				auto c = i * n + j;
+				auto unknown = this->diag[c] != 0.0f;
+				this->plusX[c] = (unknown && this->diag[c + n] != 0.0f) ? -s[c + n] : 0.0f;
+				this->plusY[c] = (unknown && this->diag[c + 1] != 0.0f) ? -s[c + 1] : 0.0f;
+			}
+		}
+
+		for (auto i = 1; i < numX - 1; i++) {
+			for (auto j = 1; j < numY - 1; j++) {
+				auto c = i * n + j;
+				if (this->diag[c] == 0.0f) {
+					this->precon[c] = 0.0f;
+					continue;
+				}
+				auto ax = this->plusX[c - n];	// coupling to (i - 1, j)
+				auto ay = this->plusY[c - 1];	// coupling to (i, j - 1)
+				auto px = this->precon[c - n];
+				auto py = this->precon[c - 1];
+				auto e = this->diag[c] - ax * ax * px * px - ay * ay * py * py -
+					this->tau * (ax * this->plusY[c - n] * px * px + ay * this->plusX[c - 1] * py * py);
+				if (e < this->sigma * this->diag[c])
+					e = this->diag[c];
+				this->precon[c] = 1.0f / sqrtf(e);
+			}
+		}
+	}
+
+	// solves A x = b from x = 0 until the residual is at most tolerance (max
+	// norm, or RMS over the unknowns) or maxIters is reached. Returns the
+	// number of iterations; the last residual norm is left in residual.
+	int solve(ThreadPool& pool, int maxIters, float tolerance, bool rms) {
+		for (auto& val : this->x) val = 0.0f;
+		this->r = this->b;
+		this->residual = this->norm(pool, rms);
+		if (this->residual <= tolerance)
+			return 0;
+
+		this->applyPrecon();
+		this->d = this->z;
+		auto rho = this->dot(pool, this->r, this->z);
+
+		for (auto iter = 0; iter < maxIters; iter++) {
+			this->applyA(pool);
+			auto dq = this->dot(pool, this->d, this->q);
+			if (dq == 0.0)
+				return iter;
+			auto alpha = (float)(rho / dq);
+
+			pool.parallelFor(0, this->numX * this->numY, [&](int c0, int c1, int) {
+				for (auto c = c0; c < c1; c++) {
+					this->x[c] += alpha * this->d[c];
+					this->r[c] -= alpha * this->q[c];
+				}
+			});
+			this->residual = this->norm(pool, rms);
+			if (this->residual <= tolerance)
+				return iter + 1;
+
+			this->applyPrecon();
+			auto rhoNew = this->dot(pool, this->r, this->z);
+			auto beta = (float)(rhoNew / rho);
+			rho = rhoNew;
+			pool.parallelFor(0, this->numX * this->numY, [&](int c0, int c1, int) {
+				for (auto c = c0; c < c1; c++)
+					this->d[c] = this->z[c] + beta * this->d[c];
+			});
+		}
+		return maxIters;
+	}
+
+	float residual{0.0f};
+
+private:
+	// per-thread sums of dot and norm, kept so the iterations do not allocate
+	std::vector<double> partial;
+	std::vector<int> count;
+
+	double dot(ThreadPool& pool, const std::vector<float>& a, const std::vector<float>& b) {
+		auto& partial = this->partial;
+		partial.assign(pool.size(), 0.0);
+		pool.parallelFor(0, this->numX * this->numY, [&](int c0, int c1, int t) {
+			auto sum = 0.0;
+			for (auto c = c0; c < c1; c++)
+				sum += (double)a[c] * b[c];
+			partial[t] = sum;
+		});
+		auto sum = 0.0;
+		for (auto val : partial) sum += val;
+		return sum;
+	}
+
+	float norm(ThreadPool& pool, bool rms) {
+		auto& partial = this->partial;
+		auto& count = this->count;
+		partial.assign(pool.size(), 0.0);
+		count.assign(pool.size(), 0);
+		pool.parallelFor(0, this->numX * this->numY, [&](int c0, int c1, int t) {
+			auto m = 0.0;
+			auto cells = 0;
+			for (auto c = c0; c < c1; c++) {
+				if (this->diag[c] == 0.0f)
+					continue;
+				if (rms)
+					m += (double)this->r[c] * this->r[c];
+				else
+					m = std::max(m, (double)fabsf(this->r[c]));
+				cells++;
+			}
+			partial[t] = m;
+			count[t] = cells;
+		});
+		if (!rms)
+			return (float)*std::max_element(partial.begin(), partial.end());
+		auto sum = 0.0;
+		auto cells = 0;
+		for (auto t = 0; t < pool.size(); t++) {
+			sum += partial[t];
+			cells += count[t];
+		}
+		return cells == 0 ? 0.0f : (float)sqrt(sum / cells);
+	}
+
+	// q = A d
+	void applyA(ThreadPool& pool) {
+		auto n = this->numY;
+		pool.parallelFor(1, this->numX - 1, [&](int i0, int i1, int) {
+			for (auto i = i0; i < i1; i++) {
+				for (auto j = 1; j < this->numY - 1; j++) {
+					auto c = i * n + j;
+					if (this->diag[c] == 0.0f) {
+						this->q[c] = 0.0f;
+						continue;
+					}
+					this->q[c] = this->diag[c] * this->d[c] +
+						this->plusX[c - n] * this->d[c - n] + this->plusX[c] * this->d[c + n] +
+						this->plusY[c - 1] * this->d[c - 1] + this->plusY[c] * this->d[c + 1];
+				}
+			}
+		});
+	}
+
+	// z = (L L^T)^-1 r
+	void applyPrecon() {
+		auto n = this->numY;
+		for (auto i = 1; i < this->numX - 1; i++) {
+			for (auto j = 1; j < this->numY - 1; j++) {
+				auto c = i * n + j;
+				if (this->diag[c] == 0.0f) {
+					this->q[c] = 0.0f;
+					continue;
+				}
+				auto t = this->r[c] -
+					this->plusX[c - n] * this->precon[c - n] * this->q[c - n] -
+					this->plusY[c - 1] * this->precon[c - 1] * this->q[c - 1];
+				this->q[c] = t * this->precon[c];
+			}
+		}
+		for (auto i = this->numX - 2; i >= 1; i--) {
+			for (auto j = this->numY - 2; j >= 1; j--) {
+				auto c = i * n + j;
+				if (this->diag[c] == 0.0f) {
+					this->z[c] = 0.0f;
+					continue;
+				}
+				auto t = this->q[c] -
+					this->plusX[c] * this->precon[c] * this->z[c + n] -
+					this->plusY[c] * this->precon[c] * this->z[c + 1];
+				this->z[c] = t * this->precon[c];
+			}
+		}
+	}
+};
@@ -0,0 +1,339 @@
+#pragma once
+// AVX2 versions of the per-cell stencil loops, chosen at run time.
+//
+// The kernels work on one grid column i (cells i * numY + j, j contiguous) in
+// blocks of 8 cells and return the first j they did not handle; the caller
+// finishes the column with its scalar code. Branches on the solid field turn
+// into lane masks, sampleField becomes four gathers.
+
+#define SIMD_SCALAR 0
+#define SIMD_AVX2 1	// also what AVX-512 machines run, there are no wider kernels
+
+// bits of Fluid::nbMask, which neighbors of a cell are fluid
+#define NB_X0 1
+#define NB_X1 2
+#define NB_Y0 4
+#define NB_Y1 8
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define SIMD_TARGET_AVX2
+#else
+#define SIMD_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#endif
+#else
+#define SIMD_X86 0
+#endif
+
+#if SIMD_X86
+
+#ifdef _MSC_VER
+inline int detectSimdLevel() {
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return SIMD_SCALAR;
+	__cpuid(info, 1);
+	auto osxsave = (info[2] & (1 << 27)) != 0;
+	auto avx = (info[2] & (1 << 28)) != 0;
+	auto fma = (info[2] & (1 << 12)) != 0;
+	if (!osxsave || !avx || !fma)
+		return SIMD_SCALAR;
+	// the OS has to save the ymm (and zmm) state on context switches
+	auto xcr0 = _xgetbv(0);
+	if ((xcr0 & 0x6) != 0x6)
+		return SIMD_SCALAR;
+	__cpuidex(info, 7, 0);
+	if (!(info[1] & (1 << 5)))
+		return SIMD_SCALAR;
+	return SIMD_AVX2;
+}
+#else
+inline int detectSimdLevel() {
+	__builtin_cpu_init();
+	if (!__builtin_cpu_supports("avx2") || !__builtin_cpu_supports("fma"))
+		return SIMD_SCALAR;
+	return SIMD_AVX2;
+}
+#endif
+
+// the four cells and weights of a bilinear sample at (x, y), 8 lanes; same
+// clamping and offsets as Fluid::sampleField. Fields stored alike share them.
+struct BilinearAVX2
+{
+	__m256i c00, c10, c11, c01;
+	__m256 w00, w10, w11, w01;
+};
+
+SIMD_TARGET_AVX2
+inline BilinearAVX2 bilinearAVX2(__m256 x, __m256 y, float dx, float dy, float h, int numX, int numY) {
+	auto h1 = _mm256_set1_ps(1.0f / h);
+	auto vh = _mm256_set1_ps(h);
+	auto one = _mm256_set1_ps(1.0f);
+
+	x = _mm256_max_ps(_mm256_min_ps(x, _mm256_set1_ps(numX * h)), vh);
+	y = _mm256_max_ps(_mm256_min_ps(y, _mm256_set1_ps(numY * h)), vh);
+	x = _mm256_sub_ps(x, _mm256_set1_ps(dx));
+	y = _mm256_sub_ps(y, _mm256_set1_ps(dy));
+
+	auto x0 = _mm256_min_epi32(_mm256_cvttps_epi32(_mm256_floor_ps(_mm256_mul_ps(x, h1))), _mm256_set1_epi32(numX - 1));
+	auto y0 = _mm256_min_epi32(_mm256_cvttps_epi32(_mm256_floor_ps(_mm256_mul_ps(y, h1))), _mm256_set1_epi32(numY - 1));
+	auto tx = _mm256_mul_ps(_mm256_sub_ps(x, _mm256_mul_ps(_mm256_cvtepi32_ps(x0), vh)), h1);
+	auto ty = _mm256_mul_ps(_mm256_sub_ps(y, _mm256_mul_ps(_mm256_cvtepi32_ps(y0), vh)), h1);
+	auto x1 = _mm256_min_epi32(_mm256_add_epi32(x0, _mm256_set1_epi32(1)), _mm256_set1_epi32(numX - 1));
+	auto y1 = _mm256_min_epi32(_mm256_add_epi32(y0, _mm256_set1_epi32(1)), _mm256_set1_epi32(numY - 1));
+	auto sx = _mm256_sub_ps(one, tx);
+	auto sy = _mm256_sub_ps(one, ty);
+
+	auto n = _mm256_set1_epi32(numY);
+	auto c0 = _mm256_mullo_epi32(x0, n);
+	auto c1 = _mm256_mullo_epi32(x1, n);
+	BilinearAVX2 b;
+	b.c00 = _mm256_add_epi32(c0, y0);
+	b.c10 = _mm256_add_epi32(c1, y0);
+	b.c11 = _mm256_add_epi32(c1, y1);
+	b.c01 = _mm256_add_epi32(c0, y1);
+	b.w00 = _mm256_mul_ps(sx, sy);
+	b.w10 = _mm256_mul_ps(tx, sy);
+	b.w11 = _mm256_mul_ps(tx, ty);
+	b.w01 = _mm256_mul_ps(sx, ty);
+	return b;
+}
+
+SIMD_TARGET_AVX2
+inline __m256 gatherAVX2(const float* f, const BilinearAVX2& b) {
+	auto val = _mm256_mul_ps(b.w00, _mm256_i32gather_ps(f, b.c00, 4));
+	val = _mm256_fmadd_ps(b.w10, _mm256_i32gather_ps(f, b.c10, 4), val);
+	val = _mm256_fmadd_ps(b.w11, _mm256_i32gather_ps(f, b.c11, 4), val);
+	val = _mm256_fmadd_ps(b.w01, _mm256_i32gather_ps(f, b.c01, 4), val);
+	return val;
+}
+
+// bilinear sample of f at (x, y), 8 lanes
+SIMD_TARGET_AVX2
+inline __m256 sampleAVX2(const float* f, __m256 x, __m256 y, float dx, float dy, float h, int numX, int numY) {
+	return gatherAVX2(f, bilinearAVX2(x, y, dx, dy, h, numX, numY));
+}
+
+// Red-black relaxation of the cells of one color in column i, the vector form
+// of Fluid::projectCell on the neighbor cache. Every lane computes its
+// correction; lanes of the other color are masked to zero, as are cells the
+// solver skips, which have a zero reciprocal count. The u faces of the column
+// are shared with the neighboring columns, whose threads write the lanes of the
+// other color in the same phase, so they are read and written only through the
+// color mask; the v faces belong to the column and get both contributions at
+// once, the one from the cell below carried over lanes.
+SIMD_TARGET_AVX2
+inline int relaxColumnAVX2(const unsigned char* nbMask, const float* nbInvCount, float* u, float* v, float* p,
+	int i, int numY, int color, float cp, float omega) {
+	auto n = numY;
+	auto one = _mm256_set1_ps(1.0f);
+	auto colorMask = _mm256_castsi256_ps((i + 1 + color) % 2 == 0 ?
+		_mm256_setr_epi32(-1, 0, -1, 0, -1, 0, -1, 0) : _mm256_setr_epi32(0, -1, 0, -1, 0, -1, 0, -1));
+	auto storeMask = _mm256_castps_si256(colorMask);
+	auto shiftUp = _mm256_setr_epi32(7, 0, 1, 2, 3, 4, 5, 6);
+	auto bitX0 = _mm256_set1_epi32(NB_X0);
+	auto bitX1 = _mm256_set1_epi32(NB_X1);
+	auto bitY0 = _mm256_set1_epi32(NB_Y0);
+	auto bitY1 = _mm256_set1_epi32(NB_Y1);
+	auto vcp = _mm256_set1_ps(cp);
+	auto vomega = _mm256_set1_ps(-omega);
+	auto carry = 0.0f;	// contribution of the cell below the block to its bottom face
+
+	auto j = 1;
+	for (; j + 8 <= numY - 1; j += 8) {
+		// the pattern starts on an odd j and advances by 8, so colorMask stays valid
+		auto c = i * n + j;
+		auto bits = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(nbMask + c)));
+		auto wx0 = _mm256_and_ps(one, _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(bits, bitX0), bitX0)));
+		auto wx1 = _mm256_and_ps(one, _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(bits, bitX1), bitX1)));
+		auto wy0 = _mm256_and_ps(one, _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(bits, bitY0), bitY0)));
+		auto wy1 = _mm256_and_ps(one, _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(bits, bitY1), bitY1)));
+
+		auto u0 = _mm256_maskload_ps(u + c, storeMask);
+		auto u1 = _mm256_maskload_ps(u + c + n, storeMask);
+		auto v0 = _mm256_loadu_ps(v + c);
+		auto v1 = _mm256_loadu_ps(v + c + 1);
+		auto div = _mm256_add_ps(_mm256_sub_ps(u1, u0), _mm256_sub_ps(v1, v0));
+		auto pc = _mm256_and_ps(colorMask, _mm256_mul_ps(_mm256_mul_ps(div, vomega), _mm256_loadu_ps(nbInvCount + c)));
+
+		_mm256_storeu_ps(p + c, _mm256_fmadd_ps(vcp, pc, _mm256_loadu_ps(p + c)));
+		_mm256_maskstore_ps(u + c, storeMask, _mm256_fnmadd_ps(wx0, pc, u0));
+		_mm256_maskstore_ps(u + c + n, storeMask, _mm256_fmadd_ps(wx1, pc, u1));
+
+		// v[j] -= wy0 * p[j] and v[j] += wy1[j - 1] * p[j - 1] from the cell below
+		auto up = _mm256_mul_ps(wy1, pc);
+		auto below = _mm256_blend_ps(_mm256_permutevar8x32_ps(up, shiftUp), _mm256_set1_ps(carry), 0x01);
+		_mm256_storeu_ps(v + c, _mm256_add_ps(_mm256_fnmadd_ps(wy0, pc, v0), below));
+		carry = _mm256_cvtss_f32(_mm256_permutevar8x32_ps(up, _mm256_set1_epi32(7)));
+	}
+	v[i * n + j] += carry;
+	return j;
+}
+
+// u and v components of the semi-Lagrangian velocity advection for column i,
+// the vector form of the loop body in Fluid::advectVel. Cells outside the
+// masks keep their velocity.
+SIMD_TARGET_AVX2
+inline int advectVelColumnAVX2(const float* s, const float* u, const float* v, float* newU, float* newV,
+	int i, int numX, int numY, float h, float dt) {
+	auto n = numY;
+	auto h2 = 0.5f * h;
+	auto zero = _mm256_setzero_ps();
+	auto quarter = _mm256_set1_ps(0.25f);
+	auto vdt = _mm256_set1_ps(dt);
+	auto lanes = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+
+	auto j = 1;
+	for (; j + 8 <= numY - 1; j += 8) {
+		auto c = i * n + j;
+		auto sc = _mm256_loadu_ps(s + c);
+		auto cellY = _mm256_mul_ps(_mm256_add_ps(_mm256_set1_ps((float)j), lanes), _mm256_set1_ps(h));
+
+		// u component
+		auto uMask = _mm256_and_ps(_mm256_cmp_ps(sc, zero, _CMP_NEQ_OQ),
+			_mm256_cmp_ps(_mm256_loadu_ps(s + c - n), zero, _CMP_NEQ_OQ));
+		auto uc = _mm256_loadu_ps(u + c);
+		auto avgV = _mm256_mul_ps(_mm256_add_ps(
+			_mm256_add_ps(_mm256_loadu_ps(v + c - n), _mm256_loadu_ps(v + c)),
+			_mm256_add_ps(_mm256_loadu_ps(v + c - n + 1), _mm256_loadu_ps(v + c + 1))), quarter);
+		auto x = _mm256_fnmadd_ps(vdt, uc, _mm256_set1_ps(i * h));
+		auto y = _mm256_fnmadd_ps(vdt, avgV, _mm256_add_ps(cellY, _mm256_set1_ps(h2)));
+		auto val = sampleAVX2(u, x, y, 0.0f, h2, h, numX, numY);
+		_mm256_storeu_ps(newU + c, _mm256_blendv_ps(uc, val, uMask));
+
+		// v component, avgU reads column i + 1
+		if (i < numX - 1) {
+			auto vMask = _mm256_and_ps(_mm256_cmp_ps(sc, zero, _CMP_NEQ_OQ),
+				_mm256_cmp_ps(_mm256_loadu_ps(s + c - 1), zero, _CMP_NEQ_OQ));
+			auto vc = _mm256_loadu_ps(v + c);
+			auto avgU = _mm256_mul_ps(_mm256_add_ps(
+				_mm256_add_ps(_mm256_loadu_ps(u + c - 1), uc),
+				_mm256_add_ps(_mm256_loadu_ps(u + c + n - 1), _mm256_loadu_ps(u + c + n))), quarter);
+			x = _mm256_fnmadd_ps(vdt, avgU, _mm256_set1_ps(i * h + h2));
+			y = _mm256_fnmadd_ps(vdt, vc, cellY);
+			val = sampleAVX2(v, x, y, h2, 0.0f, h, numX, numY);
+			_mm256_storeu_ps(newV + c, _mm256_blendv_ps(vc, val, vMask));
+		}
+	}
+	return j;
+}
+
+// smoke and channel advection for column i, the vector form of the loop body
+// in Fluid::advectSmoke; sampled values are scaled by keep
+SIMD_TARGET_AVX2
+inline int advectScalarsColumnAVX2(const float* s, const float* u, const float* v,
+	const float* const* scalars, float* const* newScalars, const float* keep, int numScalars,
+	int i, int numX, int numY, float h, float dt) {
+	auto n = numY;
+	auto h2 = 0.5f * h;
+	auto zero = _mm256_setzero_ps();
+	auto half = _mm256_set1_ps(0.5f);
+	auto vdt = _mm256_set1_ps(dt);
+	auto lanes = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+
+	auto j = 1;
+	for (; j + 8 <= numY - 1; j += 8) {
+		auto c = i * n + j;
+		auto mask = _mm256_cmp_ps(_mm256_loadu_ps(s + c), zero, _CMP_NEQ_OQ);
+		auto uc = _mm256_mul_ps(_mm256_add_ps(_mm256_loadu_ps(u + c), _mm256_loadu_ps(u + c + n)), half);
+		auto vc = _mm256_mul_ps(_mm256_add_ps(_mm256_loadu_ps(v + c), _mm256_loadu_ps(v + c + 1)), half);
+		auto cellY = _mm256_mul_ps(_mm256_add_ps(_mm256_set1_ps((float)j), lanes), _mm256_set1_ps(h));
+		auto x = _mm256_fnmadd_ps(vdt, uc, _mm256_set1_ps(i * h + h2));
+		auto y = _mm256_fnmadd_ps(vdt, vc, _mm256_add_ps(cellY, _mm256_set1_ps(h2)));
+		auto b = bilinearAVX2(x, y, h2, h2, h, numX, numY);
+		for (auto k = 0; k < numScalars; k++) {
+			auto val = _mm256_mul_ps(gatherAVX2(scalars[k], b), _mm256_set1_ps(keep[k]));
+			_mm256_storeu_ps(newScalars[k] + c, _mm256_blendv_ps(_mm256_loadu_ps(scalars[k] + c), val, mask));
+		}
+	}
+	return j;
+}
+
+// Velocity and every cell-centered scalar of column i in one pass, the vector
+// form of Fluid::advect. The faces trace back from their own positions; the
+// scalars share one trace from the cell center, and so one set of weights.
+SIMD_TARGET_AVX2
+inline int advectColumnAVX2(const float* s, const float* u, const float* v, float* newU, float* newV,
+	const float* const* scalars, float* const* newScalars, const float* keep, int numScalars,
+	int i, int numX, int numY, float h, float dt) {
+	auto n = numY;
+	auto h2 = 0.5f * h;
+	auto zero = _mm256_setzero_ps();
+	auto half = _mm256_set1_ps(0.5f);
+	auto quarter = _mm256_set1_ps(0.25f);
+	auto vdt = _mm256_set1_ps(dt);
+	auto lanes = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+	auto inner = i < numX - 1;
+
+	auto j = 1;
+	for (; j + 8 <= numY - 1; j += 8) {
+		auto c = i * n + j;
+		auto sc = _mm256_loadu_ps(s + c);
+		auto fluid = _mm256_cmp_ps(sc, zero, _CMP_NEQ_OQ);
+		auto cellY = _mm256_mul_ps(_mm256_add_ps(_mm256_set1_ps((float)j), lanes), _mm256_set1_ps(h));
+		auto uc = _mm256_loadu_ps(u + c);
+		auto vc = _mm256_loadu_ps(v + c);
+		auto v1 = _mm256_loadu_ps(v + c + 1);
+
+		// u component
+		auto uMask = _mm256_and_ps(fluid, _mm256_cmp_ps(_mm256_loadu_ps(s + c - n), zero, _CMP_NEQ_OQ));
+		auto avgV = _mm256_mul_ps(_mm256_add_ps(
+			_mm256_add_ps(_mm256_loadu_ps(v + c - n), vc),
+			_mm256_add_ps(_mm256_loadu_ps(v + c - n + 1), v1)), quarter);
+		auto x = _mm256_fnmadd_ps(vdt, uc, _mm256_set1_ps(i * h));
+		auto y = _mm256_fnmadd_ps(vdt, avgV, _mm256_add_ps(cellY, _mm256_set1_ps(h2)));
+		auto val = sampleAVX2(u, x, y, 0.0f, h2, h, numX, numY);
+		_mm256_storeu_ps(newU + c, _mm256_blendv_ps(uc, val, uMask));
+		if (!inner)
+			continue;
+
+		// v component, avgU reads column i + 1
+		auto u1 = _mm256_loadu_ps(u + c + n);
+		auto vMask = _mm256_and_ps(fluid, _mm256_cmp_ps(_mm256_loadu_ps(s + c - 1), zero, _CMP_NEQ_OQ));
+		auto avgU = _mm256_mul_ps(_mm256_add_ps(
+			_mm256_add_ps(_mm256_loadu_ps(u + c - 1), uc),
+			_mm256_add_ps(_mm256_loadu_ps(u + c + n - 1), u1)), quarter);
+		x = _mm256_fnmadd_ps(vdt, avgU, _mm256_set1_ps(i * h + h2));
+		y = _mm256_fnmadd_ps(vdt, vc, cellY);
+		val = sampleAVX2(v, x, y, h2, 0.0f, h, numX, numY);
+		_mm256_storeu_ps(newV + c, _mm256_blendv_ps(vc, val, vMask));
+
+		// scalars at the cell center
+		x = _mm256_fnmadd_ps(vdt, _mm256_mul_ps(_mm256_add_ps(uc, u1), half), _mm256_set1_ps(i * h + h2));
+		y = _mm256_fnmadd_ps(vdt, _mm256_mul_ps(_mm256_add_ps(vc, v1), half), _mm256_add_ps(cellY, _mm256_set1_ps(h2)));
+		auto b = bilinearAVX2(x, y, h2, h2, h, numX, numY);
+		for (auto k = 0; k < numScalars; k++) {
+			auto val = _mm256_mul_ps(gatherAVX2(scalars[k], b), _mm256_set1_ps(keep[k]));
+			_mm256_storeu_ps(newScalars[k] + c, _mm256_blendv_ps(_mm256_loadu_ps(scalars[k] + c), val, fluid));
+		}
+	}
+	return j;
+}
+
+#else
+
+inline int detectSimdLevel() { return SIMD_SCALAR; }
+
+inline int relaxColumnAVX2(const unsigned char*, const float*, float*, float*, float*, int, int, int, float, float) { return 1; }
+inline int advectVelColumnAVX2(const float*, const float*, const float*, float*, float*, int, int, int, float, float) { return 1; }
+inline int advectScalarsColumnAVX2(const float*, const float*, const float*, const float* const*, float* const*, const float*, int, int, int, int, float, float) { return 1; }
+inline int advectColumnAVX2(const float*, const float*, const float*, float*, float*, const float* const*, float* const*, const float*, int, int, int, int, float, float) { return 1; }
+
+#endif
+
+// detected once, on first use
+inline int cpuSimdLevel() {
+	static const int level = detectSimdLevel();
+	return level;
+}
+
+inline const char* simdLevelName(int level) {
+	switch (level) {
+		case SIMD_AVX2: return "AVX2";
+		default: return "scalar";
+	}
+}
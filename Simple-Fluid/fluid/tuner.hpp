@@ -0,0 +1,92 @@
+#pragma once
+
+#define TUNE_SETTLE_STEPS 16	// steps per candidate before measuring
+#define TUNE_STEPS 8		// steps per candidate that are measured
+#define TUNE_WIDTH 0.02f	// final width of the search interval
+
+// Online search for the SOR factor of the Gauss-Seidel and red-black solvers.
+// Each candidate runs on the real simulation and is scored by the mean number
+// of sweeps the solves needed to reach the tolerance. The error a solve leaves
+// behind carries over into the next steps, so a candidate only counts once the
+// steps run with the previous one have washed out. A golden-section search over
+// [1, 2) narrows the interval until it is TUNE_WIDTH wide, which takes 11
+// candidates.
+struct OverRelaxationTuner
+{
+	bool running{false};
+	float best{1.9f};
+
+	void start() {
+		this->lo = 1.0f;
+		this->hi = 1.99f;
+		this->x1 = this->lo + RATIO * (this->hi - this->lo);
+		this->x2 = this->hi - RATIO * (this->hi - this->lo);
+		this->f1 = -1.0f;
+		this->f2 = -1.0f;
+		this->pending = 1;
+		this->steps = 0;
+		this->sum = 0.0f;
+		this->running = true;
+	}
+
+	// omega for the next step
+	float candidate() const {
+		return this->pending == 1 ? this->x1 : this->x2;
+	}
+
+	// score of a step run with candidate(). Returns true once the search is
+	// over, the result is in best.
+	bool record(float sweeps) {
+		if (++this->steps <= TUNE_SETTLE_STEPS)
+			return false;
+		this->sum += sweeps;
+		if (this->steps < TUNE_SETTLE_STEPS + TUNE_STEPS)
+			return false;
+		auto score = this->sum / TUNE_STEPS;
+		this->steps = 0;
+		this->sum = 0.0f;
+
+		if (this->pending == 1)
+			this->f1 = score;
+		else
+			this->f2 = score;
+		if (this->f2 < 0.0f) {
+			this->pending = 2;
+			return false;
+		}
+
+		if (this->hi - this->lo < TUNE_WIDTH) {
+			this->best = this->f1 <= this->f2 ? this->x1 : this->x2;
+			this->running = false;
+			return true;
+		}
+		if (this->f1 < this->f2) {
+			this->hi = this->x2;
+			this->x2 = this->x1;
+			this->f2 = this->f1;
+			this->x1 = this->lo + RATIO * (this->hi - this->lo);
+			this->pending = 1;
+		}
+		else {
+			this->lo = this->x1;
+			this->x1 = this->x2;
+			this->f1 = this->f2;
+			this->x2 = this->hi - RATIO * (this->hi - this->lo);
+			this->pending = 2;
+		}
+		return false;
+	}
+
+private:
+	static constexpr float RATIO = 0.381966f;	// 2 - golden ratio
+
+	float lo{1.0f};
+	float hi{1.99f};
+	float x1{0.0f};
+	float x2{0.0f};
+	float f1{-1.0f};
+	float f2{-1.0f};
+	int pending{1};	// which point is being measured
+	int steps{0};
+	float sum{0.0f};
+};
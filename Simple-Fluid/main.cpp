@@ -28,6 +28,37 @@ void processInput(GLFWwindow* window);
 void mouse_button_callback(GLFWwindow* window, int button, int action, int mods);
 
 int main(int argc, char* argv[]) {
+	// --trace file.json writes a Chrome trace of the run on exit,
+	// --mask and --dye lay images over the scenes,
+	// --record prefix writes the frames to prefix000000.png, ...; --record-block waits for the disk instead of dropping frames,
+	// --checkpoint file is where F5 saves and F9 loads, --restart loads it on start,
+	// --fused advects velocity and smoke in one pass
+	std::string trace_path;
+	std::string record_prefix;
+	auto record_policy = RECORD_DROP;
+	auto restart = false;
+	for (auto a = 1; a < argc; a++) {
+		std::string arg = argv[a];
+		if (arg == "--record-block")
+			record_policy = RECORD_BLOCK;
+		else if (arg == "--restart")
+			restart = true;
+		else if (arg == "--fused")
+			renderer.scene.fusedAdvection = true;
+		else if (a + 1 >= argc)
+			break;
+		else if (arg == "--record")
+			record_prefix = argv[++a];
+		else if (arg == "--trace")
+			trace_path = argv[++a];
+		else if (arg == "--checkpoint")
+			renderer.sim.checkpointPath = argv[++a];
+		else if (arg == "--mask")
+			renderer.scene.maskPath = argv[++a];
+		else if (arg == "--dye")
+			renderer.scene.dyePath = argv[++a];
+	}
+
 	/* Initialize the library */
 	if (!glfwInit()) return -1;
 
@@ -61,6 +92,13 @@ int main(int argc, char* argv[]) {
 	}
 
 	renderer.init();
+	if (restart)
+		renderer.sim.loadCheckpoint();
+	std::cout << "SIMD kernels: " << simdLevelName(cpuSimdLevel()) << std::endl;
+	if (!trace_path.empty())
+		renderer.profiler.startTrace();
+	if (!record_prefix.empty())
+		renderer.recorder.reset(new FrameRecorder(record_prefix, record_policy));
 
 	// timing
 	float delta_time = 0.0f;
@@ -69,10 +107,12 @@ int main(int argc, char* argv[]) {
 	float sum_delta_time = 0.0f;
 	int frame_cnt = 0;
 	float delta_time_output = 0.0f;
+	int solve_iters_output = 0;
 
 	/* Loop until the user closes the window */
 	while (!glfwWindowShouldClose(window))
 	{
+		TraceScope frame_trace(&renderer.profiler, "frame");
 		auto current_time = (float)glfwGetTime();
 		if (last_time == 0.0) {
 			delta_time = 0.0;
@@ -100,11 +140,19 @@ int main(int argc, char* argv[]) {
 				sum_delta_time = 0.0f;
 			}
 			if (frame_cnt % OUTPUT_FRAME_CNT == 0) {
-				std::cout << "time for #frame" << frame_cnt << " is : " << delta_time_output / OUTPUT_FRAME_CNT << "s/frame" << std::endl;
+				std::cout << "time for #frame" << frame_cnt << " is : " << delta_time_output / OUTPUT_FRAME_CNT << "s/frame";
+				std::cout << ",   solver iterations: " << (float)solve_iters_output / OUTPUT_FRAME_CNT << "/frame" << std::endl;
+				std::cout << renderer.profiler.report();
+				if (renderer.recorder)
+					std::cout << "recorded frames: " << renderer.recorder->written() << ",   dropped: " << renderer.recorder->dropped() << std::endl;
 				delta_time_output = 0.0f;
+				solve_iters_output = 0;
 			}
 		}
-		std::string title = "Smoke   delta_time: " + std::to_string(delta_time).substr(0, 7) + "   fps: " + std::to_string(int(1 / delta_time));
+		auto& solve_stats = renderer.sim.latest().solveStats;
+		std::string title = "Smoke   delta_time: " + std::to_string(delta_time).substr(0, 7) + "   fps: " + std::to_string(int(1 / delta_time)) +
+			"   iters: " + std::to_string(solve_stats.iterations) + "   residual: " + std::to_string(solve_stats.residual) +
+			renderer.profiler.summary();
 		glfwSetWindowTitle(window, title.data());
 		/* Render here */
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
@@ -112,9 +160,13 @@ int main(int argc, char* argv[]) {
 
 		// called by each frame
 		renderer.render(0.016, view_mat, projection_mat);
+		solve_iters_output += renderer.sim.latest().solveStats.iterations;
 
 		/* Swap front and back buffers */
-		glfwSwapBuffers(window);
+		{
+			ScopedTimer timer(&renderer.profiler, PROFILE_SWAP);
+			glfwSwapBuffers(window);
+		}
 
 		/* Poll for and process events */
 		glfwPollEvents();
@@ -122,6 +174,16 @@ int main(int argc, char* argv[]) {
 		frame_cnt++;
 	}
 
+	renderer.sim.stop();
+	if (renderer.recorder) {
+		auto& recorder = *renderer.recorder.get();
+		recorder.finish();
+		std::cout << "recorded " << recorder.written() << " frames to " << record_prefix << "*.png,   dropped: " << recorder.dropped() <<
+			",   failed: " << recorder.failed() << std::endl;
+	}
+	if (!trace_path.empty() && !renderer.profiler.writeTrace(trace_path))
+		std::cout << "could not write trace to " << trace_path << std::endl;
+
 	glfwDestroyWindow(window);
 	glfwTerminate();
 
@@ -130,7 +192,13 @@ int main(int argc, char* argv[]) {
 
 void onKeyPress(GLFWwindow* window, int key, int scancode, int action, int mods)
 {
-
+	// once per press, holding the key does not set the scene up again every frame
+	if (action == GLFW_PRESS && key >= GLFW_KEY_0 && key <= GLFW_KEY_5)
+		renderer.sim.setupScene(key - GLFW_KEY_0);
+	else if (action == GLFW_PRESS && key == GLFW_KEY_F5)
+		renderer.sim.saveCheckpoint();
+	else if (action == GLFW_PRESS && key == GLFW_KEY_F9)
+		renderer.sim.loadCheckpoint();
 }
 
 // process all input: query GLFW whether relevant keys are pressed/released this frame and react accordingly
@@ -148,15 +216,6 @@ void processInput(GLFWwindow* window)
 		camera.ProcessKeyboard(LEFT, speed);
 	if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS)
 		camera.ProcessKeyboard(RIGHT, speed);
-
-	if (glfwGetKey(window, GLFW_KEY_0) == GLFW_PRESS)
-		setupScene(renderer.scene, 0);
-	if (glfwGetKey(window, GLFW_KEY_1) == GLFW_PRESS)
-		setupScene(renderer.scene, 1);
-	if (glfwGetKey(window, GLFW_KEY_2) == GLFW_PRESS)
-		setupScene(renderer.scene, 2);
-	if (glfwGetKey(window, GLFW_KEY_3) == GLFW_PRESS)
-		setupScene(renderer.scene, 3);
 }
 
 
@@ -184,7 +243,9 @@ void mouse_button_callback(GLFWwindow* window, int button, int action, int mods)
 				auto domainWidth = domainHeight / SIM_HEIGHT * SIM_WIDTH;
 				float x = xpos / width * domainWidth;
 				float y = (height - ypos) / height * domainHeight;
-				setObstacle(renderer.scene, x, y, true);
+				// a drag that follows replaces a lost move, but not the reset of the click
+				if (!renderer.sim.setObstacle(x, y, true))
+					std::cout << "input queue full, obstacle click dropped" << std::endl;
 				break;
 			}
 			case GLFW_MOUSE_BUTTON_MIDDLE:
@@ -223,7 +284,7 @@ void mouse_callback(GLFWwindow* window, double xpos, double ypos)
 		auto domainWidth = domainHeight / SIM_HEIGHT * SIM_WIDTH;
 		float x = xpos / width * domainWidth;
 		float y = (height - ypos) / height * domainHeight;
-		setObstacle(renderer.scene, x, y, false);
+		renderer.sim.setObstacle(x, y, false);	// the next move replaces one the full queue drops
 	}
 }
 
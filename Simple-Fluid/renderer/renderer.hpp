@@ -10,7 +10,8 @@
 #include <vector>
 #include <stdlib.h>
 #include <time.h>
-#include "../scene/scene.hpp"
+#include "../scene/sim_thread.hpp"
+#include "../tool/frame_recorder.h"
 
 #define STEP 1
 #define SCR_WIDTH 1280
@@ -34,6 +35,7 @@ struct Renderer
 		};
 
 		// scene
+		scene.profiler = &profiler;
 		setupScene(scene, 1);
 
 		// image
@@ -42,6 +44,9 @@ struct Renderer
 		img_data.resize(img_size_x * img_size_y * 4, (unsigned char)0);
 		glGenTextures(1, &texture);
 
+		// from here on the scene belongs to the sim thread
+		sim.start(scene);
+
 		// shader
 		auto vertex_path = "runtime/shader/opacity.vs";
 		auto fragment_path = "runtime/shader/opacity.fs";
@@ -90,60 +95,87 @@ struct Renderer
 
 	void render(float dt, glm::mat4& world_to_view_matrix, glm::mat4& view_to_clip_matrix) {
 
-		simulate(scene);
+		// the newest finished step, the sim thread is already on the next one
+		auto fresh = sim.update();
+		auto& f = sim.latest();
+		if (f.numX != img_size_x || f.numY != img_size_y) {
+			img_size_x = f.numX;
+			img_size_y = f.numY;
+			img_data.resize(img_size_x * img_size_y * 4, (unsigned char)0);
+		}
 
-		auto& f = *scene.fluid.get();
-		auto minP = f.p[0];
-		auto maxP = f.p[0];
+		{
+			ScopedTimer timer(&profiler, PROFILE_COLORIZE);
+			auto minP = f.p[0];
+			auto maxP = f.p[0];
 
-		for (int i = 0; i < f.numCells; i++) {
-			minP = std::min(minP, f.p[i]);
-			maxP = std::max(maxP, f.p[i]);
-		}
+			for (int i = 0; i < (int)f.p.size(); i++) {
+				minP = std::min(minP, f.p[i]);
+				maxP = std::max(maxP, f.p[i]);
+			}
 
-		for (int i = 0; i < img_size_x; i++) {
-			for (int j = 0; j < img_size_y; j++) {
-				auto color = glm::vec4();
-
-				if (scene.showPressure) {
-					auto p = f.p[i * img_size_y + j];
-					auto s = f.m[i * img_size_y + j];
-					color = getSciColor(p, minP, maxP);
-					if (scene.showSmoke) {
-						color[0] = std::max(0.0f, color[0] - 255 * s);
-						color[1] = std::max(0.0f, color[1] - 255 * s);
-						color[2] = std::max(0.0f, color[2] - 255 * s);
+			for (int i = 0; i < img_size_x; i++) {
+				for (int j = 0; j < img_size_y; j++) {
+					auto color = glm::vec4();
+
+					if (f.showPressure) {
+						auto p = f.p[i * img_size_y + j];
+						auto s = f.m[i * img_size_y + j];
+						color = getSciColor(p, minP, maxP);
+						if (f.showSmoke) {
+							color[0] = std::max(0.0f, color[0] - 255 * s);
+							color[1] = std::max(0.0f, color[1] - 255 * s);
+							color[2] = std::max(0.0f, color[2] - 255 * s);
+						}
+					}
+					else if (f.showSmoke) {
+						auto s = f.m[i * img_size_y + j];
+						color[0] = 255 * s;
+						color[1] = 255 * s;
+						color[2] = 255 * s;
+						if (f.sceneNr == 2 && f.numChannels > PAINT_BLUE) {
+							auto c = i * img_size_y + j;
+							auto cells = img_size_x * img_size_y;
+							color[0] = 255 * std::min(std::max(f.channels[PAINT_RED * cells + c], 0.0f), 1.0f);
+							color[1] = 255 * std::min(std::max(f.channels[PAINT_GREEN * cells + c], 0.0f), 1.0f);
+							color[2] = 255 * std::min(std::max(f.channels[PAINT_BLUE * cells + c], 0.0f), 1.0f);
+						}
+						else if (f.sceneNr == 2)
+							color = getSciColor(s, 0.0, 1.0);
+						else if (f.sceneNr == 5 && f.numChannels > HEAT_TEMPERATURE)
+							color = getSciColor(f.channels[HEAT_TEMPERATURE * img_size_x * img_size_y + i * img_size_y + j], 0.0, 1.0);
+					}
+					else if (f.s[i * img_size_y + j] == 0.0) {
+						color[0] = 0;
+						color[1] = 0;
+						color[2] = 0;
 					}
-				}
-				else if (scene.showSmoke) {
-					auto s = f.m[i * img_size_y + j];
-					color[0] = 255 * s;
-					color[1] = 255 * s;
-					color[2] = 255 * s;
-					if (scene.sceneNr == 2)
-						color = getSciColor(s, 0.0, 1.0);
-				}
-				else if (f.s[i * img_size_y + j] == 0.0) {
-					color[0] = 0;
-					color[1] = 0;
-					color[2] = 0;
-				}
 
-				img_data[4 * (img_size_x * j + i) + 0] = (unsigned char)(color.r);
-				img_data[4 * (img_size_x * j + i) + 1] = (unsigned char)(color.g);
-				img_data[4 * (img_size_x * j + i) + 2] = (unsigned char)(color.b);
-				img_data[4 * (img_size_x * j + i) + 3] = (unsigned char)(color.a);
+					img_data[4 * (img_size_x * j + i) + 0] = (unsigned char)(color.r);
+					img_data[4 * (img_size_x * j + i) + 1] = (unsigned char)(color.g);
+					img_data[4 * (img_size_x * j + i) + 2] = (unsigned char)(color.b);
+					img_data[4 * (img_size_x * j + i) + 3] = (unsigned char)(color.a);
+				}
 			}
 		}
 
+		// every step that gets drawn is recorded once
+		if (recorder && fresh) {
+			TraceScope trace(&profiler, "record");
+			recorder->submit(img_data, img_size_x, img_size_y);
+		}
+
 		// image upload
-		glBindTexture(GL_TEXTURE_2D, texture);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, img_size_x, img_size_y, 0, GL_RGBA, GL_UNSIGNED_BYTE, &img_data[0]);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-		glBindTexture(GL_TEXTURE_2D, 0);
+		{
+			ScopedTimer timer(&profiler, PROFILE_UPLOAD);
+			glBindTexture(GL_TEXTURE_2D, texture);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, img_size_x, img_size_y, 0, GL_RGBA, GL_UNSIGNED_BYTE, &img_data[0]);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+			glBindTexture(GL_TEXTURE_2D, 0);
+		}
 		
 		/* Render here */
 		glUseProgram(renderingProgram);
@@ -156,6 +188,9 @@ struct Renderer
 	}
 
 	Scene scene;
+	Profiler profiler;
+	SimThread sim;
+	std::unique_ptr<FrameRecorder> recorder;	// set to write the frames to PNGs
 
 private:
 	int img_size_x;
@@ -0,0 +1,337 @@
+#pragma once
+#include <algorithm>
+#include <fstream>
+#include <limits.h>
+#include <string>
+#include <string.h>
+#include <vector>
+#include "scene.hpp"
+#include "../tool/mapped_file.h"
+
+#define CHECKPOINT_MAGIC 0x4b434653u	// "SFCK"
+#define CHECKPOINT_VERSION 3	// 2 added the channels, 3 the buoyancy; older ones still load
+#define CHECKPOINT_MAX_CHANNELS 64	// more is taken for a corrupt count
+
+// 64-bit FNV-1a over 8-byte words, which keeps hashing a large grid well
+// under the time it takes to read it. Bytes that do not fill a word are held
+// back for the next update.
+struct CheckpointHash
+{
+	unsigned long long value{14695981039346656037ull};
+
+	void update(const void* data, size_t size) {
+		auto bytes = (const unsigned char*)data;
+		while (size > 0 && this->numPending > 0) {
+			this->add(*bytes++);
+			size--;
+		}
+		for (; size >= 8; bytes += 8, size -= 8) {
+			unsigned long long word;
+			memcpy(&word, bytes, 8);
+			this->value = (this->value ^ word) * 1099511628211ull;
+		}
+		while (size-- > 0)
+			this->add(*bytes++);
+	}
+
+	unsigned long long finish() {
+		if (this->numPending > 0)
+			this->value = (this->value ^ this->pending) * 1099511628211ull;
+		this->numPending = 0;
+		this->pending = 0;
+		return this->value;
+	}
+
+private:
+	unsigned long long pending{0};
+	int numPending{0};
+
+	void add(unsigned char b) {
+		this->pending |= (unsigned long long)b << (8 * this->numPending);
+		if (++this->numPending == 8) {
+			this->value = (this->value ^ this->pending) * 1099511628211ull;
+			this->pending = 0;
+			this->numPending = 0;
+		}
+	}
+};
+
+// everything after the header goes through the hash
+struct CheckpointWriter
+{
+	std::ofstream out;
+	CheckpointHash hash;
+	unsigned long long size{0};
+
+	template <typename T>
+	void put(const T& value) {
+		this->write(&value, sizeof(T));
+	}
+
+	template <typename T>
+	void putArray(const std::vector<T>& values) {
+		this->put((int)values.size());
+		if (!values.empty())
+			this->write(&values[0], values.size() * sizeof(T));
+	}
+
+	void write(const void* data, size_t size) {
+		this->out.write((const char*)data, size);
+		this->hash.update(data, size);
+		this->size += size;
+	}
+};
+
+// reads the mapped payload in place; a read past the end clears ok
+struct CheckpointReader
+{
+	const unsigned char* at{nullptr};
+	const unsigned char* end{nullptr};
+	bool ok{true};
+
+	template <typename T>
+	T get() {
+		T value{};
+		this->read(&value, sizeof(T));
+		return value;
+	}
+
+	template <typename T>
+	void getArray(std::vector<T>& values, int maxSize) {
+		auto size = this->get<int>();
+		if (size < 0 || size > maxSize) {
+			this->ok = false;
+			size = 0;
+		}
+		values.resize(size);
+		if (size > 0)
+			this->read(&values[0], size * sizeof(T));
+	}
+
+	void read(void* data, size_t size) {
+		if (!this->ok || (size_t)(this->end - this->at) < size) {
+			this->ok = false;
+			return;
+		}
+		memcpy(data, this->at, size);
+		this->at += size;
+	}
+};
+
+// header: magic, version, payload size, payload hash; the payload holds the
+// grid, the scene parameters, the obstacles, the fluid arrays, the images,
+// the channels and the buoyancy
+inline bool saveCheckpoint(const Scene& scene, const std::string& path) {
+	auto& f = *scene.fluid.get();
+	CheckpointWriter w;
+	w.out.open(path, std::ios::binary);
+	if (!w.out)
+		return false;
+	unsigned int magic = CHECKPOINT_MAGIC;
+	int version = CHECKPOINT_VERSION;
+	unsigned long long placeholder = 0;
+	w.out.write((const char*)&magic, sizeof(magic));
+	w.out.write((const char*)&version, sizeof(version));
+	w.out.write((const char*)&placeholder, sizeof(placeholder));
+	w.out.write((const char*)&placeholder, sizeof(placeholder));
+
+	w.put(f.numX);
+	w.put(f.numY);
+	w.put(f.h);
+	w.put(f.density);
+
+	w.put(scene.sceneNr);
+	w.put(scene.frameNr);
+	w.put(scene.resolution);
+	w.put(scene.numIters);
+	w.put(scene.gravity);
+	w.put(scene.dt);
+	w.put(scene.overRelaxation);
+	w.put(scene.obstacleRadius);
+	w.put((unsigned char)scene.showPressure);
+	w.put((unsigned char)scene.showSmoke);
+	w.put((unsigned char)scene.showObstacle);
+	w.put((unsigned char)scene.obstaclesDrawn);
+
+	w.put((int)scene.obstacles.size());
+	for (auto& o : scene.obstacles) {
+		w.put(o.shape);
+		w.put(o.x);
+		w.put(o.y);
+		w.put(o.angle);
+		w.put(o.vx);
+		w.put(o.vy);
+		w.put((unsigned char)o.kinematic);
+		w.put(o.radius);
+		w.put(o.halfWidth);
+		w.put(o.halfHeight);
+		w.putArray(o.points);
+		w.put((unsigned char)o.drawn);
+		w.put((unsigned char)o.moved);
+		w.put(o.minI);
+		w.put(o.maxI);
+		w.put(o.minJ);
+		w.put(o.maxJ);
+	}
+
+	w.putArray(f.u);
+	w.putArray(f.v);
+	w.putArray(f.p);
+	w.putArray(f.s);
+	w.putArray(f.m);
+
+	w.putArray(scene.images.solid);
+	w.putArray(scene.images.dyeCells);
+	w.putArray(scene.images.dyeValues);
+
+	w.put(f.numChannels);
+	w.putArray(f.channelDissipation);
+	w.putArray(f.channels);
+
+	w.put(f.temperatureChannel);
+	w.put(f.ambientTemperature);
+	w.put(f.buoyancy);
+	w.put(f.smokeWeight);
+
+	auto checksum = w.hash.finish();
+	w.out.seekp(sizeof(magic) + sizeof(version));
+	w.out.write((const char*)&w.size, sizeof(w.size));
+	w.out.write((const char*)&checksum, sizeof(checksum));
+	w.out.close();
+	return !w.out.fail();
+}
+
+// The file is mapped rather than streamed, so a restart of a large grid costs
+// little more than reading it. The scene is only touched once the whole file
+// has checked out: a bad file leaves the running scene as it was.
+inline bool loadCheckpoint(Scene& scene, const std::string& path) {
+	MappedFile file;
+	if (!file.open(path.c_str()))
+		return false;
+
+	unsigned int magic = 0;
+	int version = 0;
+	unsigned long long size = 0, checksum = 0;
+	CheckpointReader header{file.data(), file.data() + file.size()};
+	header.read(&magic, sizeof(magic));
+	header.read(&version, sizeof(version));
+	header.read(&size, sizeof(size));
+	header.read(&checksum, sizeof(checksum));
+	if (!header.ok || magic != CHECKPOINT_MAGIC || version < 1 || version > CHECKPOINT_VERSION || size != (unsigned long long)(header.end - header.at))
+		return false;
+	CheckpointHash hash;
+	hash.update(header.at, (size_t)size);
+	if (hash.finish() != checksum)
+		return false;
+
+	CheckpointReader r{header.at, header.end};
+	auto numX = r.get<int>();
+	auto numY = r.get<int>();
+	auto h = r.get<float>();
+	auto density = r.get<float>();
+	if (!r.ok || numX < 3 || numY < 3 || (long long)numX * numY > 1 << 28)
+		return false;
+	auto numCells = numX * numY;
+
+	Scene loaded;
+	loaded.sceneNr = r.get<int>();
+	loaded.frameNr = r.get<int>();
+	loaded.resolution = r.get<int>();
+	loaded.numIters = r.get<int>();
+	loaded.gravity = r.get<float>();
+	loaded.dt = r.get<float>();
+	loaded.overRelaxation = r.get<float>();
+	loaded.obstacleRadius = r.get<float>();
+	loaded.showPressure = r.get<unsigned char>() != 0;
+	loaded.showSmoke = r.get<unsigned char>() != 0;
+	loaded.showObstacle = r.get<unsigned char>() != 0;
+	loaded.obstaclesDrawn = r.get<unsigned char>() != 0;
+
+	auto numObstacles = r.get<int>();
+	if (!r.ok || numObstacles < 0 || numObstacles > numCells)
+		return false;
+	loaded.obstacles.resize(numObstacles);
+	for (auto& o : loaded.obstacles) {
+		o.shape = r.get<int>();
+		o.x = r.get<float>();
+		o.y = r.get<float>();
+		o.angle = r.get<float>();
+		o.vx = r.get<float>();
+		o.vy = r.get<float>();
+		o.kinematic = r.get<unsigned char>() != 0;
+		o.radius = r.get<float>();
+		o.halfWidth = r.get<float>();
+		o.halfHeight = r.get<float>();
+		r.getArray(o.points, 2 * numCells);
+		o.drawn = r.get<unsigned char>() != 0;
+		o.moved = r.get<unsigned char>() != 0;
+		o.minI = r.get<int>();
+		o.maxI = r.get<int>();
+		o.minJ = r.get<int>();
+		o.maxJ = r.get<int>();
+	}
+
+	std::unique_ptr<Fluid> fluid(new Fluid(density, numX - 2, numY - 2, h, scene.numThreads));
+	r.getArray(fluid->u, numCells);
+	r.getArray(fluid->v, numCells);
+	r.getArray(fluid->p, numCells);
+	r.getArray(fluid->s, numCells);
+	r.getArray(fluid->m, numCells);
+	r.getArray(loaded.images.solid, numCells);
+	r.getArray(loaded.images.dyeCells, numCells);
+	r.getArray(loaded.images.dyeValues, numCells);
+	if (version >= 2) {
+		fluid->numChannels = r.get<int>();
+		if (fluid->numChannels < 0 || fluid->numChannels > CHECKPOINT_MAX_CHANNELS)
+			return false;
+		r.getArray(fluid->channelDissipation, fluid->numChannels);
+		r.getArray(fluid->channels, (int)std::min((long long)fluid->numChannels * numCells, (long long)INT_MAX));
+		fluid->newChannels.resize(fluid->channels.size());
+	}
+	if (version >= 3) {
+		fluid->temperatureChannel = r.get<int>();
+		fluid->ambientTemperature = r.get<float>();
+		fluid->buoyancy = r.get<float>();
+		fluid->smokeWeight = r.get<float>();
+		if (fluid->temperatureChannel < -1 || fluid->temperatureChannel >= fluid->numChannels)
+			return false;
+	}
+	if (!r.ok || r.at != r.end)
+		return false;
+	auto fullSize = [numCells](size_t n) { return n == (size_t)numCells; };
+	if (!fullSize(fluid->u.size()) || !fullSize(fluid->v.size()) || !fullSize(fluid->p.size()) ||
+		!fullSize(fluid->s.size()) || !fullSize(fluid->m.size()) ||
+		(!loaded.images.solid.empty() && !fullSize(loaded.images.solid.size())) ||
+		loaded.images.dyeCells.size() != loaded.images.dyeValues.size() ||
+		(int)fluid->channelDissipation.size() != fluid->numChannels ||
+		fluid->channels.size() != (size_t)fluid->numChannels * numCells)
+		return false;
+	for (auto c : loaded.images.dyeCells) {
+		if (c < 0 || c >= numCells)
+			return false;
+	}
+	for (auto& o : loaded.obstacles) {
+		if (o.minI < 0 || o.maxI > numX || o.minJ < 0 || o.maxJ > numY)
+			return false;
+	}
+
+	scene.sceneNr = loaded.sceneNr;
+	scene.frameNr = loaded.frameNr;
+	scene.resolution = loaded.resolution;
+	scene.numIters = loaded.numIters;
+	scene.gravity = loaded.gravity;
+	scene.dt = loaded.dt;
+	scene.overRelaxation = loaded.overRelaxation;
+	scene.obstacleRadius = loaded.obstacleRadius;
+	scene.showPressure = loaded.showPressure;
+	scene.showSmoke = loaded.showSmoke;
+	scene.showObstacle = loaded.showObstacle;
+	scene.obstaclesDrawn = loaded.obstaclesDrawn;
+	scene.obstacles.swap(loaded.obstacles);
+	loaded.images.numX = numX;
+	loaded.images.numY = numY;
+	scene.images = std::move(loaded.images);
+	scene.fluid = std::move(fluid);
+	scene.fluid->solidChanged();
+	return true;
+}
@@ -0,0 +1,157 @@
+#pragma once
+#include <algorithm>
+#include <vector>
+#include <math.h>
+
+#define SHAPE_CIRCLE 0
+#define SHAPE_BOX 1
+#define SHAPE_CAPSULE 2
+#define SHAPE_POLYGON 3
+
+// A rigid body in the domain, described by its signed distance: negative
+// inside, positive outside. Positions are in domain units (the domain is 1
+// high), the shape is given around (x, y) and turned by angle.
+struct Obstacle
+{
+	int shape{SHAPE_CIRCLE};
+	float x{0.0f};
+	float y{0.0f};
+	float angle{0.0f};	// radians, counterclockwise
+	float vx{0.0f};
+	float vy{0.0f};
+	bool kinematic{false};	// moves by vx, vy every step, else only when placed
+	float radius{0.0f};	// circle, capsule
+	float halfWidth{0.0f};	// box; capsule: half the length of its axis
+	float halfHeight{0.0f};	// box
+	std::vector<float> points;	// polygon: x0, y0, x1, y1, ... around (x, y)
+
+	// the cells it was last drawn into, [minI, maxI) x [minJ, maxJ)
+	bool drawn{false};
+	bool moved{true};
+	int minI{0};
+	int maxI{0};
+	int minJ{0};
+	int maxJ{0};
+
+	float distance(float px, float py) const {
+		// into the frame of the shape
+		auto lx = px - this->x;
+		auto ly = py - this->y;
+		if (this->angle != 0.0f) {
+			auto c = cosf(this->angle);
+			auto s = sinf(this->angle);
+			auto dx = lx;
+			lx = c * dx + s * ly;
+			ly = -s * dx + c * ly;
+		}
+
+		switch (this->shape) {
+			case SHAPE_BOX: {
+				auto qx = fabsf(lx) - this->halfWidth;
+				auto qy = fabsf(ly) - this->halfHeight;
+				auto ox = std::max(qx, 0.0f);
+				auto oy = std::max(qy, 0.0f);
+				return sqrtf(ox * ox + oy * oy) + std::min(std::max(qx, qy), 0.0f);
+			}
+			case SHAPE_CAPSULE: {
+				lx -= std::min(std::max(lx, -this->halfWidth), this->halfWidth);
+				return sqrtf(lx * lx + ly * ly) - this->radius;
+			}
+			case SHAPE_POLYGON:
+				return this->polygonDistance(lx, ly);
+			default:
+				return sqrtf(lx * lx + ly * ly) - this->radius;
+		}
+	}
+
+	// what the grid is drawn from; circles skip the square root, which also
+	// keeps them to the cells they covered before there were other shapes
+	bool inside(double px, double py) const {
+		if (this->shape == SHAPE_CIRCLE) {
+			auto dx = px - this->x;
+			auto dy = py - this->y;
+			return dx * dx + dy * dy < this->radius * this->radius;
+		}
+		return this->distance((float)px, (float)py) < 0.0f;
+	}
+
+	// radius of a circle around (x, y) that holds the whole shape
+	float extent() const {
+		switch (this->shape) {
+			case SHAPE_BOX: return sqrtf(this->halfWidth * this->halfWidth + this->halfHeight * this->halfHeight);
+			case SHAPE_CAPSULE: return this->halfWidth + this->radius;
+			case SHAPE_POLYGON: {
+				auto r2 = 0.0f;
+				for (size_t k = 0; k + 1 < this->points.size(); k += 2)
+					r2 = std::max(r2, this->points[k] * this->points[k] + this->points[k + 1] * this->points[k + 1]);
+				return sqrtf(r2);
+			}
+			default: return this->radius;
+		}
+	}
+
+private:
+	// distance to the closest edge, negative for an odd number of crossings
+	float polygonDistance(float px, float py) const {
+		auto& pt = this->points;
+		auto num = (int)pt.size() / 2;
+		if (num < 3)
+			return 1e30f;
+		auto d2 = 1e30f;
+		auto inside = false;
+		for (auto a = 0, b = num - 1; a < num; b = a, a++) {
+			auto ax = pt[2 * a], ay = pt[2 * a + 1];
+			auto bx = pt[2 * b], by = pt[2 * b + 1];
+			auto ex = bx - ax, ey = by - ay;
+			auto wx = px - ax, wy = py - ay;
+			auto t = std::min(std::max((wx * ex + wy * ey) / (ex * ex + ey * ey), 0.0f), 1.0f);
+			auto qx = wx - ex * t, qy = wy - ey * t;
+			d2 = std::min(d2, qx * qx + qy * qy);
+			if ((ay > py) != (by > py) && px < ax + (py - ay) * ex / ey)
+				inside = !inside;
+		}
+		return inside ? -sqrtf(d2) : sqrtf(d2);
+	}
+};
+
+inline Obstacle circleObstacle(float x, float y, float radius) {
+	Obstacle o;
+	o.shape = SHAPE_CIRCLE;
+	o.x = x;
+	o.y = y;
+	o.radius = radius;
+	return o;
+}
+
+inline Obstacle boxObstacle(float x, float y, float halfWidth, float halfHeight, float angle = 0.0f) {
+	Obstacle o;
+	o.shape = SHAPE_BOX;
+	o.x = x;
+	o.y = y;
+	o.halfWidth = halfWidth;
+	o.halfHeight = halfHeight;
+	o.angle = angle;
+	return o;
+}
+
+// rounded segment of length 2 * halfLength along angle
+inline Obstacle capsuleObstacle(float x, float y, float halfLength, float radius, float angle = 0.0f) {
+	Obstacle o;
+	o.shape = SHAPE_CAPSULE;
+	o.x = x;
+	o.y = y;
+	o.halfWidth = halfLength;
+	o.radius = radius;
+	o.angle = angle;
+	return o;
+}
+
+inline Obstacle polygonObstacle(float x, float y, const std::vector<float>& points, float angle = 0.0f) {
+	Obstacle o;
+	o.shape = SHAPE_POLYGON;
+	o.x = x;
+	o.y = y;
+	o.points = points;
+	o.angle = angle;
+	return o;
+}
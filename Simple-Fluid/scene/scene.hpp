@@ -1,8 +1,25 @@
 #pragma once
 #include <memory.h>
+#include <iostream>
+#include <memory>
+#include <map>
+#include <string>
+#include <tuple>
+#include <vector>
 #include "../fluid/fluid.hpp"
+#include "obstacle.hpp"
+#include "scene_image.hpp"
 #define SIM_WIDTH 1280
 #define SIM_HEIGHT 720
+#define OBSTACLE_TILE 16	// cells per side of the tiles obstacles are redrawn in
+#define TUNE_OBSTACLE_STEP 0.1f	// obstacles placed closer than this share a tuned overRelaxation
+
+#define PAINT_RED 0	// the dye channels of the paint scene
+#define PAINT_GREEN 1
+#define PAINT_BLUE 2
+
+#define HEAT_TEMPERATURE 0	// the temperature channel of the plume scene
+#define HEAT_SOURCE_RADIUS 0.06f	// of the burner at the bottom of the plume scene
 
 struct Scene
 {
@@ -11,79 +28,300 @@ struct Scene
 	int numIters{100};
 	int frameNr{0};
 	float overRelaxation{1.9};
-	float obstacleX{0.0};
-	float obstacleY{0.0};
-	float obstacleRadius{0.15};
+	float obstacleRadius{0.15};	// of the obstacle under the mouse
+	std::vector<Obstacle> obstacles;	// the first one follows the mouse
+	bool obstaclesDrawn{false};	// the grid has been cleared for them once
+	std::string maskPath;	// optional PNG/BMP, dark is solid, laid over every scene
+	std::string dyePath;	// optional PNG/BMP, opaque pixels are dye sources
+	SceneImages images;
 	bool paused{false};
 	int sceneNr{0};
+	int resolution{100};	// cells across the domain height
 	bool showObstacle{false};
 	bool showStreamlines{false};
 	bool showVelocities{false};
 	bool showPressure{false};
 	bool showSmoke{true};
+	int solver{SOLVER_GAUSS_SEIDEL};
+	int numThreads{0};	// 0: one per hardware thread
+	float tolerance{1e-4};	// divergence at which the pressure solve stops
+	int checkInterval{0};	// sweeps between residual checks, 0: always run numIters (4 with warmStart)
+	int residualNorm{RESIDUAL_MAX};
+	bool warmStart{false};	// start the solve from the last step's pressure
+	bool fusedAdvection{false};	// advect velocity and smoke in one pass
+	bool autoOverRelaxation{false};	// tune overRelaxation instead of using the scene's value
+	std::map<std::tuple<int, int, int, int, unsigned long long>, float> tunedOverRelaxation;	// by scene, numX, numY, solver, domainHash
+	Profiler* profiler{nullptr};	// passed on to the fluid
 	std::unique_ptr<Fluid> fluid;
 };
 
+inline void moveObstacles(Scene& scene);
+
+// the burner of the plume scene keeps the cells over it hot and smoky
+inline void applyHeatSource(Scene& scene) {
+	auto& f = *scene.fluid.get();
+	if (f.temperatureChannel < 0)
+		return;
+	auto n = f.numY;
+	auto x = 0.5f * f.numX * f.h;
+	auto y = 2.0f * HEAT_SOURCE_RADIUS;
+	auto temperature = f.channel(f.temperatureChannel);
+	auto minI = std::max(1, (int)((x - HEAT_SOURCE_RADIUS) / f.h));
+	auto maxI = std::min(f.numX - 1, (int)((x + HEAT_SOURCE_RADIUS) / f.h) + 1);
+	auto minJ = std::max(1, (int)((y - HEAT_SOURCE_RADIUS) / f.h));
+	auto maxJ = std::min(f.numY - 1, (int)((y + HEAT_SOURCE_RADIUS) / f.h) + 1);
+	for (auto i = minI; i < maxI; i++) {
+		for (auto j = minJ; j < maxJ; j++) {
+			auto dx = (i + 0.5f) * f.h - x;
+			auto dy = (j + 0.5f) * f.h - y;
+			if (dx * dx + dy * dy < HEAT_SOURCE_RADIUS * HEAT_SOURCE_RADIUS && f.s[i * n + j] != 0.0f) {
+				temperature[i * n + j] = 1.0f;
+				f.m[i * n + j] = 0.0f;
+			}
+		}
+	}
+}
+
+// FNV-1a over what the tuned overRelaxation depends on: the mask and the
+// obstacles with where they were placed. Kinematic obstacles sweep the domain
+// by design, so only their shape counts, and placed ones only to the nearest
+// TUNE_OBSTACLE_STEP, else dragging one would retune on every step.
+inline unsigned long long domainHash(const Scene& scene) {
+	auto h = 14695981039346656037ull;
+	auto mix = [&](const void* data, size_t size) {
+		for (size_t b = 0; b < size; b++)
+			h = (h ^ ((const unsigned char*)data)[b]) * 1099511628211ull;
+	};
+	if (!scene.images.solid.empty())
+		mix(&scene.images.solid[0], scene.images.solid.size());
+	for (auto& o : scene.obstacles) {
+		int placed[3] = { o.shape, 0, 0 };
+		if (!o.kinematic) {
+			placed[1] = (int)floorf(o.x / TUNE_OBSTACLE_STEP + 0.5f);
+			placed[2] = (int)floorf(o.y / TUNE_OBSTACLE_STEP + 0.5f);
+		}
+		float size[4] = { o.radius, o.halfWidth, o.halfHeight, o.kinematic ? 0.0f : o.angle };
+		mix(placed, sizeof(placed));
+		mix(size, sizeof(size));
+		if (!o.points.empty())
+			mix(&o.points[0], o.points.size() * sizeof(float));
+	}
+	return h;
+}
+
 inline void simulate(Scene& scene)
 {
 	if (!scene.paused) {
-		scene.fluid->simulate(scene.dt, scene.gravity, scene.numIters);
+		auto& f = *scene.fluid.get();
+		f.solver = scene.solver;
+		f.tolerance = scene.tolerance;
+		f.checkInterval = scene.checkInterval;
+		f.residualNorm = scene.residualNorm;
+		f.warmStart = scene.warmStart;
+		f.fusedAdvection = scene.fusedAdvection;
+		f.profiler = scene.profiler;
+
+		// the Fluid tunes on the first step with something to solve
+		auto tuning = false;
+		auto key = std::make_tuple(scene.sceneNr, f.numX, f.numY, scene.solver, 0ull);
+		f.overRelaxation = scene.overRelaxation;
+		if (scene.autoOverRelaxation && (scene.solver == SOLVER_GAUSS_SEIDEL || scene.solver == SOLVER_RED_BLACK)) {
+			std::get<4>(key) = domainHash(scene);
+			auto tuned = scene.tunedOverRelaxation.find(key);
+			if (tuned != scene.tunedOverRelaxation.end())
+				f.overRelaxation = tuned->second;
+			else
+				tuning = f.tuneOverRelaxation = true;
+		}
+
+		{
+			ScopedTimer timer(scene.profiler, PROFILE_SOURCES);
+			moveObstacles(scene);
+			for (size_t k = 0; k < scene.images.dyeCells.size(); k++)
+				f.m[scene.images.dyeCells[k]] = scene.images.dyeValues[k];
+			if (scene.sceneNr == 5)
+				applyHeatSource(scene);
+		}
+		f.simulate(scene.dt, scene.gravity, scene.numIters);
+		if (tuning && !f.tuneOverRelaxation)
+			scene.tunedOverRelaxation[key] = f.overRelaxation;
 		scene.frameNr++;
 	}
 }
 
-inline void setObstacle(Scene& scene, float x, float y, bool reset) {
+// Redraws the tiles of the grid that an obstacle left or entered since the
+// last call: s is reset to fluid there, then every obstacle overlapping the
+// tile is drawn with its dye and face velocities. A cell only writes its own
+// s, m and lower faces, so the tiles go over the pool in parallel.
+inline void drawObstacles(Scene& scene) {
+	auto& f = *scene.fluid.get();
+	auto n = f.numY;
+	auto h = f.h;
+	auto numTilesX = (f.numX + OBSTACLE_TILE - 1) / OBSTACLE_TILE;
+	auto numTilesY = (f.numY + OBSTACLE_TILE - 1) / OBSTACLE_TILE;
 
-	auto vx = 0.0;
-	auto vy = 0.0;
+	// a fresh grid is cleared once, everything the obstacles were not drawn on
+	// before had s set by setupScene; the image mask stays solid
+	std::vector<unsigned char> dirty(numTilesX * numTilesY, scene.obstaclesDrawn ? 0 : 1);
+	auto markTiles = [&](int minI, int maxI, int minJ, int maxJ) {
+		if (minI >= maxI || minJ >= maxJ)
+			return;
+		for (auto ti = minI / OBSTACLE_TILE; ti <= (maxI - 1) / OBSTACLE_TILE; ti++) {
+			for (auto tj = minJ / OBSTACLE_TILE; tj <= (maxJ - 1) / OBSTACLE_TILE; tj++)
+				dirty[ti * numTilesY + tj] = 1;
+		}
+	};
+	for (auto& o : scene.obstacles) {
+		if (!o.moved && scene.obstaclesDrawn)
+			continue;
+		if (o.drawn)
+			markTiles(o.minI, o.maxI, o.minJ, o.maxJ);
+		// the cells whose centers can lie in the shape, with a cell to spare,
+		// and the faces above and right of them
+		auto r = o.extent();
+		o.minI = std::max(1, (int)floor((o.x - r) / h) - 1);
+		o.maxI = std::min(f.numX - 1, (int)ceil((o.x + r) / h) + 2);
+		o.minJ = std::max(1, (int)floor((o.y - r) / h) - 1);
+		o.maxJ = std::min(f.numY - 1, (int)ceil((o.y + r) / h) + 2);
+		markTiles(o.minI, o.maxI, o.minJ, o.maxJ);
+		o.drawn = true;
+		o.moved = false;
+	}
+	scene.obstaclesDrawn = true;
 
-	if (!reset) {
-		vx = (x - scene.obstacleX) / scene.dt;
-		vy = (y - scene.obstacleY) / scene.dt;
+	std::vector<int> tiles;
+	for (auto t = 0; t < (int)dirty.size(); t++) {
+		if (dirty[t])
+			tiles.push_back(t);
 	}
+	if (tiles.empty())
+		return;
 
-	scene.obstacleX = x;
-	scene.obstacleY = y;
-	auto r = scene.obstacleRadius;
-	auto& f = *scene.fluid.get();
-	auto n = f.numY;
-	auto cd = std::sqrt(2.f) * f.h;
-
-	for (auto i = 1; i < f.numX - 2; i++) {
-		for (auto j = 1; j < f.numY - 2; j++) {
-
-			f.s[i * n + j] = 1.0;
-
-			auto dx = (i + 0.5) * f.h - x;
-			auto dy = (j + 0.5) * f.h - y;
-
-			if (dx * dx + dy * dy < r * r) {
-				f.s[i * n + j] = 0.0;
-				if (scene.sceneNr == 2)
-					f.m[i * n + j] = 0.5 + 0.5 * std::sin(0.1 * scene.frameNr);
-				else
-					f.m[i * n + j] = 1.0;
-				f.u[i * n + j] = vx;
-				f.u[(i + 1) * n + j] = vx;
-				f.v[i * n + j] = vy;
-				f.v[i * n + j + 1] = vy;
+	float dye = scene.sceneNr == 2 ? 0.5 + 0.5 * std::sin(0.1 * scene.frameNr) : 1.0;
+	// the paint scene paints with a hue that goes round over time
+	auto painting = scene.sceneNr == 2 && f.numChannels > PAINT_BLUE;
+	float paint[3];
+	for (auto k = 0; k < 3; k++)
+		paint[k] = 0.5 + 0.5 * std::sin(0.1 * scene.frameNr + 2.0944 * k);
+	f.pool->parallelFor(0, (int)tiles.size(), [&](int t0, int t1, int) {
+		std::vector<const Obstacle*> near;
+		std::vector<const Obstacle*> inside;
+		for (auto t = t0; t < t1; t++) {
+			auto i0 = std::max(1, tiles[t] / numTilesY * OBSTACLE_TILE);
+			auto i1 = std::min(f.numX - 1, (tiles[t] / numTilesY + 1) * OBSTACLE_TILE);
+			auto j0 = std::max(1, tiles[t] % numTilesY * OBSTACLE_TILE);
+			auto j1 = std::min(f.numY - 1, (tiles[t] % numTilesY + 1) * OBSTACLE_TILE);
+			if (i0 >= i1 || j0 >= j1)
+				continue;
+
+			near.clear();
+			for (auto& o : scene.obstacles) {
+				if (o.minI < i1 && o.maxI >= i0 && o.minJ < j1 && o.maxJ >= j0)
+					near.push_back(&o);
+			}
+
+			// the obstacle covering each cell of the tile and the row and column
+			// below it, obstacles are only drawn into [1, numX - 2) x [1, numY - 2)
+			auto w = j1 - j0 + 1;
+			inside.assign((i1 - i0 + 1) * w, nullptr);
+			for (auto i = i0 - 1; i < i1; i++) {
+				for (auto j = j0 - 1; j < j1; j++) {
+					if (i < 1 || i >= f.numX - 2 || j < 1 || j >= f.numY - 2)
+						continue;
+					for (auto o : near) {
+						if (o->inside((i + 0.5) * h, (j + 0.5) * h)) {
+							inside[(i - i0 + 1) * w + j - j0 + 1] = o;
+							break;
+						}
+					}
+				}
+			}
+
+			for (auto i = i0; i < i1; i++) {
+				for (auto j = j0; j < j1; j++) {
+					auto c = i * n + j;
+					auto o = inside[(i - i0 + 1) * w + j - j0 + 1];
+					if (i < f.numX - 2 && j < f.numY - 2) {
+						f.s[c] = o || (!scene.images.solid.empty() && scene.images.solid[c]) ? 0.0f : 1.0f;
+						if (o)
+							f.m[c] = dye;
+						if (o && painting) {
+							f.channel(PAINT_RED)[c] = paint[0];
+							f.channel(PAINT_GREEN)[c] = paint[1];
+							f.channel(PAINT_BLUE)[c] = paint[2];
+						}
+					}
+					// a face takes the velocity of the obstacle on either side, its own cell first
+					auto left = o ? o : inside[(i - i0) * w + j - j0 + 1];
+					auto below = o ? o : inside[(i - i0 + 1) * w + j - j0];
+					if (left)
+						f.u[c] = left->vx;
+					if (below)
+						f.v[c] = below->vy;
+				}
 			}
 		}
+	});
+
+	f.solidChanged();
+}
+
+// moves the first obstacle, the one under the mouse; reset places it without
+// giving it the velocity of the jump
+inline void setObstacle(Scene& scene, float x, float y, bool reset) {
+	if (scene.obstacles.empty())
+		scene.obstacles.push_back(circleObstacle(x, y, scene.obstacleRadius));
+	auto& o = scene.obstacles[0];
+
+	o.vx = 0.0f;
+	o.vy = 0.0f;
+	if (!reset) {
+		o.vx = (x - o.x) / scene.dt;
+		o.vy = (y - o.y) / scene.dt;
 	}
+	o.x = x;
+	o.y = y;
+	o.moved = true;
 
+	drawObstacles(scene);
 	scene.showObstacle = true;
 }
 
+// kinematic obstacles move by their velocity and bounce off the domain walls
+inline void moveObstacles(Scene& scene) {
+	auto& f = *scene.fluid.get();
+	auto width = f.numX * f.h;
+	auto height = f.numY * f.h;
+	auto moving = false;
+	for (auto& o : scene.obstacles) {
+		if (!o.kinematic)
+			continue;
+		o.x += o.vx * scene.dt;
+		o.y += o.vy * scene.dt;
+		auto r = o.extent();
+		if ((o.x - r < 0.0f && o.vx < 0.0f) || (o.x + r > width && o.vx > 0.0f))
+			o.vx = -o.vx;
+		if ((o.y - r < 0.0f && o.vy < 0.0f) || (o.y + r > height && o.vy > 0.0f))
+			o.vy = -o.vy;
+		o.moved = true;
+		moving = true;
+	}
+	if (moving)
+		drawObstacles(scene);
+}
+
 inline void setupScene(Scene& scene, int sceneNr = 0)
 {
 	scene.sceneNr = sceneNr;
 	scene.obstacleRadius = 0.15;
+	scene.obstacles.clear();
+	scene.obstaclesDrawn = false;
 	scene.overRelaxation = 1.9;
 
 	scene.dt = 1.0 / 60.0;
 	scene.numIters = 40;
 
-	auto res = 100;
+	auto res = scene.resolution;
 
 	//if (sceneNr == 0)
 	//	res = 50;
@@ -99,11 +337,19 @@ inline void setupScene(Scene& scene, int sceneNr = 0)
 
 	auto density = 1000.0;
 
-	scene.fluid = std::move(std::unique_ptr<Fluid>(new Fluid(density, numX, numY, h)));
+	scene.fluid = std::move(std::unique_ptr<Fluid>(new Fluid(density, numX, numY, h, scene.numThreads)));
 	auto& f = *scene.fluid.get();
 
 	auto n = f.numY;
 
+	// loaded before the obstacles are first drawn, which keep the mask solid;
+	// the mask goes over whatever the scene set up at the end
+	scene.images = SceneImages();
+	if (!scene.maskPath.empty() || !scene.dyePath.empty()) {
+		if (!scene.images.load(scene.maskPath, scene.dyePath, f.numX, f.numY))
+			std::cout << "could not load the scene images " << scene.maskPath << " " << scene.dyePath << std::endl;
+	}
+
 	if (sceneNr == 0) {   		// tank
 
 		for (auto i = 0; i < f.numX; i++) {
@@ -120,7 +366,7 @@ inline void setupScene(Scene& scene, int sceneNr = 0)
 		scene.showStreamlines = false;
 		scene.showVelocities = false;
 	}
-	else if (sceneNr == 1 || sceneNr == 3) { // vortex shedding
+	else if (sceneNr == 1 || sceneNr == 3 || sceneNr == 4) { // vortex shedding
 
 		auto inVel = 2.0;
 		for (auto i = 0; i < f.numX; i++) {
@@ -143,6 +389,8 @@ inline void setupScene(Scene& scene, int sceneNr = 0)
 		for (auto j = minJ; j < maxJ; j++)
 			f.m[j] = 0.0;
 
+		if (sceneNr == 4)
+			scene.obstacleRadius = 0.08;
 		setObstacle(scene, 0.4, 0.5, true);
 
 		scene.gravity = 0.0;
@@ -157,6 +405,16 @@ inline void setupScene(Scene& scene, int sceneNr = 0)
 			scene.showPressure = true;
 		}
 
+		if (sceneNr == 4) {	// obstacle course
+			scene.obstacles.push_back(boxObstacle(0.8f, 0.3f, 0.1f, 0.04f, 0.5f));
+			scene.obstacles.push_back(polygonObstacle(0.85f, 0.72f, { -0.08f, -0.06f, 0.1f, 0.0f, -0.08f, 0.06f }));
+			auto paddle = capsuleObstacle(1.3f, 0.5f, 0.08f, 0.03f, 1.2f);
+			paddle.kinematic = true;
+			paddle.vy = 0.3f;
+			scene.obstacles.push_back(paddle);
+			drawObstacles(scene);
+		}
+
 	}
 	else if (sceneNr == 2) { // paint
 
@@ -167,5 +425,40 @@ inline void setupScene(Scene& scene, int sceneNr = 0)
 		scene.showStreamlines = false;
 		scene.showVelocities = false;
 		scene.obstacleRadius = 0.1;
+		for (auto k = PAINT_RED; k <= PAINT_BLUE; k++)
+			f.addChannel(0.0f);
+	}
+	else if (sceneNr == 5) { // hot plume
+
+		for (auto i = 0; i < f.numX; i++) {
+			for (auto j = 0; j < f.numY; j++) {
+				auto s = 1.0;	// fluid
+				if (i == 0 || i == f.numX - 1 || j == 0 || j == f.numY - 1)
+					s = 0.0;	// solid
+				f.s[i * n + j] = s;
+			}
+		}
+		// gravity only acts through the buoyancy, which holds it relative to the ambient air
+		scene.gravity = 0.0;
+		f.temperatureChannel = f.addChannel(0.0f, 0.3f);
+		f.ambientTemperature = 0.0f;
+		f.buoyancy = 3.0f;
+		f.smokeWeight = 0.5f;
+		scene.obstacleRadius = 0.08;
+		scene.showPressure = false;
+		scene.showSmoke = true;
+		scene.showStreamlines = false;
+		scene.showVelocities = false;
+	}
+
+	if (!scene.images.solid.empty()) {
+		for (auto c = 0; c < (int)scene.images.solid.size(); c++) {
+			if (!scene.images.solid[c])
+				continue;
+			f.s[c] = 0.0;
+			f.u[c] = f.u[c + n] = 0.0;
+			f.v[c] = f.v[c + 1] = 0.0;
+		}
+		f.solidChanged();
 	}
 }
\ No newline at end of file
@@ -0,0 +1,181 @@
+#pragma once
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include "../tool/stb_image.h"
+
+#define SCENE_IMAGE_CACHE_VERSION 1
+#define SCENE_IMAGE_SOLID_BELOW 0.5f	// mask luminance under which a cell is solid
+#define SCENE_IMAGE_DYE_ALPHA 0.5f	// dye map coverage from which a cell is a source
+
+// Geometry from images, resampled to a grid of numX * numY cells (ghost ring
+// included, which the images are not drawn into). The mask is stretched over
+// the domain, dark is solid. Where the dye map is opaque, a cell is a dye
+// source that keeps m at the luminance of the map.
+struct SceneImages
+{
+	int numX{0};
+	int numY{0};
+	std::vector<unsigned char> solid;	// 1: solid, empty without a mask
+	std::vector<int> dyeCells;
+	std::vector<float> dyeValues;
+
+	// decoding and resampling are skipped when the sidecar next to the images
+	// was written for the same files and grid
+	bool load(const std::string& maskPath, const std::string& dyePath, int numX, int numY) {
+		this->numX = numX;
+		this->numY = numY;
+		this->solid.clear();
+		this->dyeCells.clear();
+		this->dyeValues.clear();
+
+		std::vector<unsigned char> maskFile, dyeFile;
+		if ((!maskPath.empty() && !readFile(maskPath, maskFile)) || (!dyePath.empty() && !readFile(dyePath, dyeFile)))
+			return false;
+		auto maskHash = hash(maskFile);
+		auto dyeHash = hash(dyeFile);
+		auto cachePath = (maskPath.empty() ? dyePath : maskPath) + "." + std::to_string(numX) + "x" + std::to_string(numY) + ".cache";
+		if (this->readCache(cachePath, maskHash, dyeHash))
+			return true;
+
+		std::vector<float> lum, alpha;
+		if (!maskFile.empty()) {
+			if (!this->resample(maskFile, lum, alpha))
+				return false;
+			this->solid.assign(numX * numY, 0);
+			for (auto c = 0; c < numX * numY; c++)
+				this->solid[c] = alpha[c] > 0.0f && lum[c] < SCENE_IMAGE_SOLID_BELOW ? 1 : 0;
+		}
+		if (!dyeFile.empty()) {
+			if (!this->resample(dyeFile, lum, alpha))
+				return false;
+			for (auto c = 0; c < numX * numY; c++) {
+				if (alpha[c] >= SCENE_IMAGE_DYE_ALPHA) {
+					this->dyeCells.push_back(c);
+					this->dyeValues.push_back(lum[c]);
+				}
+			}
+		}
+		this->writeCache(cachePath, maskHash, dyeHash);
+		return true;
+	}
+
+private:
+	static bool readFile(const std::string& path, std::vector<unsigned char>& data) {
+		std::ifstream in(path, std::ios::binary);
+		if (!in)
+			return false;
+		data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+		return !data.empty();
+	}
+
+	// FNV-1a, 0 for no file
+	static unsigned long long hash(const std::vector<unsigned char>& data) {
+		if (data.empty())
+			return 0;
+		auto h = 14695981039346656037ull;
+		for (auto b : data)
+			h = (h ^ b) * 1099511628211ull;
+		return h;
+	}
+
+	// average luminance and alpha of the pixels over every interior cell,
+	// 0 in the ghost ring. Image rows go down, grid rows up.
+	bool resample(const std::vector<unsigned char>& file, std::vector<float>& lum, std::vector<float>& alpha) {
+		int w, h, n;
+		auto pixels = stbi_load_from_memory(&file[0], (int)file.size(), &w, &h, &n, 4);
+		if (!pixels)
+			return false;
+
+		auto nx = this->numX - 2;
+		auto ny = this->numY - 2;
+		lum.assign(this->numX * this->numY, 0.0f);
+		alpha.assign(this->numX * this->numY, 0.0f);
+		for (auto i = 0; i < nx; i++) {
+			auto x0 = (int)((long long)i * w / nx);
+			auto x1 = std::max(x0 + 1, (int)((long long)(i + 1) * w / nx));
+			for (auto j = 0; j < ny; j++) {
+				auto y0 = (int)((long long)(ny - 1 - j) * h / ny);
+				auto y1 = std::max(y0 + 1, (int)((long long)(ny - j) * h / ny));
+				auto sumLum = 0.0f, sumAlpha = 0.0f;
+				for (auto y = y0; y < y1; y++) {
+					for (auto x = x0; x < x1; x++) {
+						auto p = pixels + 4 * ((long long)y * w + x);
+						auto a = p[3] / 255.0f;
+						sumLum += a * (0.299f * p[0] + 0.587f * p[1] + 0.114f * p[2]) / 255.0f;
+						sumAlpha += a;
+					}
+				}
+				auto c = (i + 1) * this->numY + j + 1;
+				alpha[c] = sumAlpha / ((x1 - x0) * (y1 - y0));
+				lum[c] = sumAlpha > 0.0f ? sumLum / sumAlpha : 0.0f;
+			}
+		}
+		stbi_image_free(pixels);
+		return true;
+	}
+
+	// header: version, numX, numY, mask hash, dye hash; then the solid and dye arrays with their sizes
+	bool readCache(const std::string& path, unsigned long long maskHash, unsigned long long dyeHash) {
+		std::ifstream in(path, std::ios::binary);
+		int version = 0, numX = 0, numY = 0;
+		unsigned long long cachedMask = 0, cachedDye = 0;
+		in.read((char*)&version, sizeof(version));
+		in.read((char*)&numX, sizeof(numX));
+		in.read((char*)&numY, sizeof(numY));
+		in.read((char*)&cachedMask, sizeof(cachedMask));
+		in.read((char*)&cachedDye, sizeof(cachedDye));
+		if (!in || version != SCENE_IMAGE_CACHE_VERSION || numX != this->numX || numY != this->numY ||
+			cachedMask != maskHash || cachedDye != dyeHash)
+			return false;
+
+		int numSolid = 0, numDye = 0;
+		in.read((char*)&numSolid, sizeof(numSolid));
+		in.read((char*)&numDye, sizeof(numDye));
+		if (!in || (numSolid != 0 && numSolid != numX * numY) || numDye < 0 || numDye > numX * numY)
+			return false;
+		this->solid.resize(numSolid);
+		this->dyeCells.resize(numDye);
+		this->dyeValues.resize(numDye);
+		if (numSolid > 0)
+			in.read((char*)&this->solid[0], numSolid);
+		if (numDye > 0) {
+			in.read((char*)&this->dyeCells[0], numDye * sizeof(int));
+			in.read((char*)&this->dyeValues[0], numDye * sizeof(float));
+		}
+		// the payload is not hashed; dye cells index the grid directly, so one
+		// outside it rejects the sidecar and the images get decoded again
+		auto valid = (bool)in;
+		for (auto k = 0; valid && k < numDye; k++)
+			valid = this->dyeCells[k] >= 0 && this->dyeCells[k] < numX * numY;
+		if (valid)
+			return true;
+		this->solid.clear();
+		this->dyeCells.clear();
+		this->dyeValues.clear();
+		return false;
+	}
+
+	// a cache that cannot be written only costs the next start the decoding
+	void writeCache(const std::string& path, unsigned long long maskHash, unsigned long long dyeHash) {
+		std::ofstream out(path, std::ios::binary);
+		int version = SCENE_IMAGE_CACHE_VERSION;
+		auto numSolid = (int)this->solid.size();
+		auto numDye = (int)this->dyeCells.size();
+		out.write((const char*)&version, sizeof(version));
+		out.write((const char*)&this->numX, sizeof(this->numX));
+		out.write((const char*)&this->numY, sizeof(this->numY));
+		out.write((const char*)&maskHash, sizeof(maskHash));
+		out.write((const char*)&dyeHash, sizeof(dyeHash));
+		out.write((const char*)&numSolid, sizeof(numSolid));
+		out.write((const char*)&numDye, sizeof(numDye));
+		if (numSolid > 0)
+			out.write((const char*)&this->solid[0], numSolid);
+		if (numDye > 0) {
+			out.write((const char*)&this->dyeCells[0], numDye * sizeof(int));
+			out.write((const char*)&this->dyeValues[0], numDye * sizeof(float));
+		}
+	}
+};
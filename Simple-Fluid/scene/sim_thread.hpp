@@ -0,0 +1,212 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "checkpoint.hpp"
+#include "scene.hpp"
+#include "../tool/spsc_queue.h"
+#include "../tool/triple_buffer.h"
+
+#define SIM_STEPS_PER_SECOND 60	// the rate the viewer stepped at while it simulated once per vsynced frame
+#define SIM_COMMAND_CAPACITY 256
+
+#define SIM_LOAD_CHECKPOINT -1	// in the scene request slot instead of a scene number
+
+// an obstacle move, queued by the render thread
+struct Command
+{
+	float x{0.0f};
+	float y{0.0f};
+	bool reset{false};
+	int switchNr{0};	// scene switches requested before it, the move belongs to the scene of the last
+};
+
+// what the renderer needs of one finished step
+struct Snapshot
+{
+	int numX{0};
+	int numY{0};
+	int sceneNr{0};
+	int frameNr{0};
+	bool showPressure{false};
+	bool showSmoke{false};
+	SolveStats solveStats;
+	std::vector<float> m;
+	std::vector<float> p;
+	std::vector<float> s;
+	int numChannels{0};
+	std::vector<float> channels;	// channel k at k * numX * numY, as in the Fluid
+
+	void capture(const Scene& scene) {
+		auto& f = *scene.fluid.get();
+		this->numX = f.numX;
+		this->numY = f.numY;
+		this->sceneNr = scene.sceneNr;
+		this->frameNr = scene.frameNr;
+		this->showPressure = scene.showPressure;
+		this->showSmoke = scene.showSmoke;
+		this->solveStats = f.solveStats;
+		this->m.assign(f.m.begin(), f.m.end());
+		this->p.assign(f.p.begin(), f.p.end());
+		this->s.assign(f.s.begin(), f.s.end());
+		this->numChannels = f.numChannels;
+		this->channels.assign(f.channels.begin(), f.channels.end());
+	}
+};
+
+// Steps the scene on its own thread at SIM_STEPS_PER_SECOND and hands every
+// step to the renderer through a triple buffer, so the render thread never
+// waits for the solve and the next step runs while the last one is drawn.
+// Input reaches the scene only between steps: obstacle moves through the
+// command queue, scene switches, checkpoint loads and saves through slots
+// that only keep the latest request, so a full queue can never drop them.
+struct SimThread
+{
+	~SimThread() {
+		this->stop();
+	}
+
+	void start(Scene& scene) {
+		this->scene = &scene;
+		this->publish();
+		this->snapshots.update();
+		this->running = true;
+		this->thread = std::thread([this]() { this->loop(); });
+	}
+
+	void stop() {
+		if (!this->thread.joinable())
+			return;
+		this->running = false;
+		this->thread.join();
+	}
+
+	// render thread: queues input for the next step boundary, false if the queue is full
+	bool setObstacle(float x, float y, bool reset) {
+		Command command;
+		command.x = x;
+		command.y = y;
+		command.reset = reset;
+		command.switchNr = this->switchNr;
+		return this->commands.push(command);
+	}
+
+	void setupScene(int sceneNr) {
+		this->requestScene(sceneNr);
+	}
+
+	// to and from checkpointPath, between steps like all input
+	void saveCheckpoint() {
+		this->saveRequested.store(true, std::memory_order_release);
+	}
+
+	void loadCheckpoint() {
+		this->requestScene(SIM_LOAD_CHECKPOINT);
+	}
+
+	// render thread: picks up the newest step, true if there was one
+	bool update() { return this->snapshots.update(); }
+
+	const Snapshot& latest() const { return this->snapshots.front(); }
+
+	std::string checkpointPath{"checkpoint.sfc"};	// set before start
+
+private:
+	Scene* scene{nullptr};
+	std::thread thread;
+	std::atomic<bool> running{false};
+	SpscQueue<Command, SIM_COMMAND_CAPACITY> commands;
+	TripleBuffer<Snapshot> snapshots;
+
+	// the last scene switch or load, its switch number in the high half and the
+	// scene number or SIM_LOAD_CHECKPOINT in the low half
+	std::atomic<unsigned long long> sceneRequest{0};
+	std::atomic<bool> saveRequested{false};
+	int switchNr{0};	// render thread, switches requested so far
+	int appliedSwitchNr{0};	// sim thread, switches applied so far
+
+	void requestScene(int request) {
+		this->switchNr++;
+		this->sceneRequest.store(((unsigned long long)this->switchNr << 32) | (unsigned int)request, std::memory_order_release);
+	}
+
+	// Only the last scene switch and the last obstacle position since the last
+	// step matter, so the queue is drained first and those are applied once.
+	// The scene request is read after the queue: it was stored before any move
+	// that carries its switch number was pushed, so it is at least as new as
+	// the newest move. Moves queued before a switch belong to the old scene and
+	// are dropped; a reset among the coalesced moves makes the move a reset,
+	// else the obstacle would get the velocity of the whole jump. Loading a
+	// checkpoint counts as a scene switch; a save is written after everything
+	// else was applied.
+	void applyCommands() {
+		auto move = false;
+		Command obstacle;
+		Command command;
+		while (this->commands.pop(command)) {
+			if (move && command.switchNr != obstacle.switchNr)
+				move = false;
+			obstacle.reset = (move && obstacle.reset) || command.reset;
+			obstacle.x = command.x;
+			obstacle.y = command.y;
+			obstacle.switchNr = command.switchNr;
+			move = true;
+		}
+
+		auto request = this->sceneRequest.load(std::memory_order_acquire);
+		auto requestNr = (int)(request >> 32);
+		auto load = false;
+		if (requestNr != this->appliedSwitchNr) {
+			this->appliedSwitchNr = requestNr;
+			auto sceneNr = (int)(unsigned int)request;
+			load = sceneNr == SIM_LOAD_CHECKPOINT;
+			if (!load)
+				::setupScene(*this->scene, sceneNr);
+		}
+		move = move && obstacle.switchNr == this->appliedSwitchNr;
+		auto save = this->saveRequested.exchange(false, std::memory_order_acquire);
+		if (load) {
+			TraceScope trace(this->scene->profiler, "load checkpoint");
+			if (::loadCheckpoint(*this->scene, this->checkpointPath))
+				std::cout << "loaded " << this->checkpointPath << " at frame " << this->scene->frameNr << std::endl;
+			else
+				std::cout << "could not load checkpoint " << this->checkpointPath << std::endl;
+		}
+		if (move)
+			::setObstacle(*this->scene, obstacle.x, obstacle.y, obstacle.reset);
+		if (save) {
+			TraceScope trace(this->scene->profiler, "save checkpoint");
+			if (::saveCheckpoint(*this->scene, this->checkpointPath))
+				std::cout << "saved " << this->checkpointPath << " at frame " << this->scene->frameNr << std::endl;
+			else
+				std::cout << "could not save checkpoint " << this->checkpointPath << std::endl;
+		}
+	}
+
+	void publish() {
+		TraceScope trace(this->scene->profiler, "snapshot");
+		this->snapshots.back().capture(*this->scene);
+		this->snapshots.publish();
+	}
+
+	void loop() {
+		auto period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1.0 / SIM_STEPS_PER_SECOND));
+		auto next = std::chrono::steady_clock::now();
+		while (this->running) {
+			this->applyCommands();
+			simulate(*this->scene);
+			this->publish();
+
+			// a step that ran late moves the schedule instead of being caught up on
+			next += period;
+			auto now = std::chrono::steady_clock::now();
+			if (next < now)
+				next = now;
+			else
+				std::this_thread::sleep_until(next);
+		}
+	}
+};
@@ -0,0 +1,143 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <stdio.h>
+#include <string>
+#include <thread>
+#include <vector>
+// svpng into memory: fputc takes the stream lock for every byte
+#define SVPNG_LINKAGE inline
+#define SVPNG_OUTPUT std::vector<unsigned char>& out
+#define SVPNG_PUT(u) out.push_back((unsigned char)(u))
+#include "svpng.h"
+
+#define RECORD_DROP 0	// a frame that finds the queue full is not written
+#define RECORD_BLOCK 1	// the caller waits for a writer instead
+
+// Writes RGBA frames to prefix000000.png, prefix000001.png, ... on a few
+// writer threads. submit() only copies the frame into a queue of at most
+// capacity frames; what happens when it is full is up to the policy.
+struct FrameRecorder
+{
+	FrameRecorder(const std::string& prefix, int policy = RECORD_DROP, int numWriters = 2, int capacity = 8) {
+		this->prefix = prefix;
+		this->policy = policy;
+		this->capacity = std::max(1, capacity);
+		for (auto t = 0; t < std::max(1, numWriters); t++)
+			this->writers.emplace_back([this]() { this->writerLoop(); });
+	}
+
+	~FrameRecorder() {
+		this->finish();
+	}
+
+	// writes what is still queued and stops the writers, later frames are dropped
+	void finish() {
+		{
+			std::lock_guard<std::mutex> lock(this->mutex);
+			this->quit = true;
+		}
+		this->wake.notify_all();
+		this->space.notify_all();
+		for (auto& w : this->writers) {
+			if (w.joinable())
+				w.join();
+		}
+	}
+
+	FrameRecorder(const FrameRecorder&) = delete;
+	FrameRecorder& operator=(const FrameRecorder&) = delete;
+
+	// rows of rgba go bottom to top, as for a GL texture; false if the frame was dropped
+	bool submit(const std::vector<unsigned char>& rgba, int width, int height) {
+		std::unique_lock<std::mutex> lock(this->mutex);
+		if (this->policy == RECORD_BLOCK)
+			this->space.wait(lock, [this]() { return this->quit || (int)this->queue.size() < this->capacity; });
+		if (this->quit || (int)this->queue.size() >= this->capacity) {
+			this->numDropped++;
+			return false;
+		}
+
+		Frame frame;
+		if (!this->spare.empty()) {
+			frame.rgba.swap(this->spare.back());
+			this->spare.pop_back();
+		}
+		frame.index = this->numQueued++;
+		frame.width = width;
+		frame.height = height;
+		frame.rgba.resize(rgba.size());
+		// PNG rows go top to bottom
+		auto pitch = 4 * width;
+		for (auto y = 0; y < height; y++)
+			std::copy(rgba.begin() + (height - 1 - y) * pitch, rgba.begin() + (height - y) * pitch, frame.rgba.begin() + y * pitch);
+		this->queue.push_back(std::move(frame));
+		lock.unlock();
+		this->wake.notify_one();
+		return true;
+	}
+
+	int dropped() const { return this->numDropped; }
+	int written() const { return this->numWritten; }
+	int failed() const { return this->numFailed; }
+
+private:
+	struct Frame
+	{
+		int index{0};
+		int width{0};
+		int height{0};
+		std::vector<unsigned char> rgba;
+	};
+
+	std::string prefix;
+	int policy;
+	int capacity;
+	std::vector<std::thread> writers;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable space;
+	std::deque<Frame> queue;
+	std::vector<std::vector<unsigned char>> spare;	// pixel buffers of written frames, reused by submit
+	bool quit{false};
+	int numQueued{0};
+	std::atomic<int> numDropped{0};
+	std::atomic<int> numWritten{0};
+	std::atomic<int> numFailed{0};
+
+	void writerLoop() {
+		std::vector<unsigned char> png;
+		for (;;) {
+			Frame frame;
+			{
+				std::unique_lock<std::mutex> lock(this->mutex);
+				this->wake.wait(lock, [this]() { return this->quit || !this->queue.empty(); });
+				if (this->queue.empty())
+					return;
+				frame = std::move(this->queue.front());
+				this->queue.pop_front();
+			}
+			this->space.notify_one();
+
+			char number[16];
+			snprintf(number, sizeof(number), "%06d", frame.index);
+			auto path = this->prefix + number + ".png";
+			png.clear();
+			svpng(png, frame.width, frame.height, &frame.rgba[0], 1);
+			auto fp = fopen(path.c_str(), "wb");
+			auto ok = fp && fwrite(&png[0], 1, png.size(), fp) == png.size();
+			if (fp && fclose(fp) != 0)
+				ok = false;
+			if (ok)
+				this->numWritten++;
+			else
+				this->numFailed++;
+
+			std::lock_guard<std::mutex> lock(this->mutex);
+			this->spare.push_back(std::move(frame.rgba));
+		}
+	}
+};
@@ -0,0 +1,79 @@
+#include "mapped_file.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+
+bool MappedFile::open(const char* path) {
+	this->close();
+	auto file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	this->file = file;
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+		this->close();
+		return false;
+	}
+	this->mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!this->mapping) {
+		this->close();
+		return false;
+	}
+	this->bytes = (const unsigned char*)MapViewOfFile(this->mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!this->bytes) {
+		this->close();
+		return false;
+	}
+	this->length = (size_t)size.QuadPart;
+	return true;
+}
+
+void MappedFile::close() {
+	if (this->bytes)
+		UnmapViewOfFile(this->bytes);
+	if (this->mapping)
+		CloseHandle(this->mapping);
+	if (this->file)
+		CloseHandle(this->file);
+	this->bytes = nullptr;
+	this->length = 0;
+	this->mapping = nullptr;
+	this->file = nullptr;
+}
+
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+bool MappedFile::open(const char* path) {
+	this->close();
+	auto fd = ::open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		::close(fd);
+		return false;
+	}
+	// the mapping stays valid after the descriptor is closed
+	auto bytes = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (bytes == MAP_FAILED)
+		return false;
+	madvise(bytes, (size_t)st.st_size, MADV_SEQUENTIAL);
+	this->bytes = (const unsigned char*)bytes;
+	this->length = (size_t)st.st_size;
+	return true;
+}
+
+void MappedFile::close() {
+	if (this->bytes)
+		munmap((void*)this->bytes, this->length);
+	this->bytes = nullptr;
+	this->length = 0;
+}
+#endif
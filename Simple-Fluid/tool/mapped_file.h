@@ -0,0 +1,29 @@
+#pragma once
+#include <stddef.h>
+
+// A whole file mapped read-only into memory, so reading it costs the page
+// faults and no copy through a stream buffer. The platform code lives in
+// mapped_file.cpp to keep windows.h out of the headers.
+struct MappedFile
+{
+	MappedFile() {}
+
+	~MappedFile() {
+		this->close();
+	}
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	bool open(const char* path);
+	void close();
+
+	const unsigned char* data() const { return this->bytes; }
+	size_t size() const { return this->length; }
+
+private:
+	const unsigned char* bytes{nullptr};
+	size_t length{0};
+	void* file{nullptr};	// Windows file and mapping handles
+	void* mapping{nullptr};
+};
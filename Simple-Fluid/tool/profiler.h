@@ -0,0 +1,241 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// stages timed with ScopedTimer
+#define PROFILE_SOURCES 0	// obstacles, dye and heat sources written into the grid
+#define PROFILE_INTEGRATE 1
+#define PROFILE_SOLVE 2
+#define PROFILE_EXTRAPOLATE 3
+#define PROFILE_ADVECT_VEL 4
+#define PROFILE_ADVECT_SMOKE 5
+#define PROFILE_ADVECT 6	// both of the above in one pass
+#define PROFILE_COLORIZE 7
+#define PROFILE_UPLOAD 8
+#define PROFILE_SWAP 9
+#define PROFILE_NUM_STAGES 10
+
+#define PROFILE_WINDOW 256	// samples per stage the statistics run over
+#define TRACE_MAX_EVENTS 4000000	// later events are dropped, about 100MB of JSON
+
+// one complete ("X") event of the Chrome trace format, times in us from the trace start
+struct TraceEvent
+{
+	const char* name;
+	double start;
+	double duration;
+	int tid;
+};
+
+// the last PROFILE_WINDOW durations of one stage, in ms, and the sum of all of them
+struct RollingStats
+{
+	void add(double ms) {
+		if ((int)this->samples.size() < PROFILE_WINDOW)
+			this->samples.push_back(ms);
+		else
+			this->samples[this->next] = ms;
+		this->next = (this->next + 1) % PROFILE_WINDOW;
+		this->sum += ms;
+	}
+
+	int count() const { return (int)this->samples.size(); }
+
+	double total() const { return this->sum; }
+
+	double mean() const {
+		if (this->samples.empty())
+			return 0.0;
+		auto sum = 0.0;
+		for (auto ms : this->samples) sum += ms;
+		return sum / this->samples.size();
+	}
+
+	double max() const {
+		if (this->samples.empty())
+			return 0.0;
+		return *std::max_element(this->samples.begin(), this->samples.end());
+	}
+
+	// nearest rank, q in [0, 1]
+	double percentile(double q) const {
+		if (this->samples.empty())
+			return 0.0;
+		auto sorted = this->samples;
+		auto k = std::min((int)sorted.size() - 1, (int)(q * sorted.size()));
+		std::nth_element(sorted.begin(), sorted.begin() + k, sorted.end());
+		return sorted[k];
+	}
+
+private:
+	std::vector<double> samples;
+	int next{0};
+	double sum{0.0};
+};
+
+struct Profiler
+{
+	RollingStats stages[PROFILE_NUM_STAGES];
+
+	// stages can be recorded from different threads, summary and report lock against them
+	void record(int stage, double ms) {
+		std::lock_guard<std::mutex> lock(this->statsMutex);
+		this->stages[stage].add(ms);
+	}
+
+	// ms spent in a stage since the profiler was made
+	double total(int stage) const {
+		std::lock_guard<std::mutex> lock(this->statsMutex);
+		return this->stages[stage].total();
+	}
+
+	static const char* stageName(int stage) {
+		static const char* names[PROFILE_NUM_STAGES] = { "sources", "integrate", "solve", "extrapolate", "advectVel", "advectSmoke", "advect", "colorize", "upload", "swap" };
+		return names[stage];
+	}
+
+	// small ids in the order threads first show up, the thread starting the trace is 0
+	static int threadId() {
+		static std::atomic<int> next{0};
+		thread_local int id = next.fetch_add(1);
+		return id;
+	}
+
+	// may run while the sim thread and the pool already record: traceStart is
+	// written before the release store that lets the readers see it
+	void startTrace() {
+		threadId();
+		this->traceStart = std::chrono::steady_clock::now();
+		this->tracing.store(true, std::memory_order_release);
+	}
+
+	bool isTracing() const { return this->tracing.load(std::memory_order_acquire); }
+
+	// may be called from any thread
+	void trace(const char* name, std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end) {
+		auto tid = threadId();
+		auto ts = std::chrono::duration<double, std::micro>(start - this->traceStart).count();
+		auto dur = std::chrono::duration<double, std::micro>(end - start).count();
+		std::lock_guard<std::mutex> lock(this->traceMutex);
+		if (this->events.size() < TRACE_MAX_EVENTS)
+			this->events.push_back({ name, ts, dur, tid });
+	}
+
+	// Chrome trace event JSON, loads in chrome://tracing and Perfetto
+	bool writeTrace(const std::string& path) {
+		std::ofstream out(path);
+		if (!out)
+			return false;
+		std::lock_guard<std::mutex> lock(this->traceMutex);
+		auto numThreads = 0;
+		for (auto& e : this->events)
+			numThreads = std::max(numThreads, e.tid + 1);
+
+		out << std::fixed << std::setprecision(3);
+		out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[" << std::endl;
+		for (auto t = 0; t < numThreads; t++) {
+			out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":" << t <<
+				",\"args\":{\"name\":\"" << (t == 0 ? "main" : "thread " + std::to_string(t)) << "\"}}," << std::endl;
+		}
+		for (size_t e = 0; e < this->events.size(); e++) {
+			auto& event = this->events[e];
+			out << "{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << event.tid <<
+				",\"ts\":" << event.start << ",\"dur\":" << event.duration << "}" << (e + 1 < this->events.size() ? "," : "") << std::endl;
+		}
+		out << "]}" << std::endl;
+		return (bool)out;
+	}
+
+	// mean ms of the stages that ran, on one line
+	std::string summary() const {
+		std::lock_guard<std::mutex> lock(this->statsMutex);
+		std::stringstream out;
+		out << std::fixed << std::setprecision(2);
+		for (auto stage = 0; stage < PROFILE_NUM_STAGES; stage++) {
+			if (this->stages[stage].count() > 0)
+				out << "   " << stageName(stage) << ": " << this->stages[stage].mean();
+		}
+		return out.str();
+	}
+
+	// mean, p50, p99 and max ms of every stage that ran, one line each
+	std::string report() const {
+		std::lock_guard<std::mutex> lock(this->statsMutex);
+		std::stringstream out;
+		out << std::fixed << std::setprecision(3);
+		out << std::left << std::setw(14) << "stage (ms)" << std::right << std::setw(10) << "mean" <<
+			std::setw(10) << "p50" << std::setw(10) << "p99" << std::setw(10) << "max" << std::endl;
+		for (auto stage = 0; stage < PROFILE_NUM_STAGES; stage++) {
+			auto& stats = this->stages[stage];
+			if (stats.count() == 0)
+				continue;
+			out << std::left << std::setw(14) << stageName(stage) << std::right << std::setw(10) << stats.mean() <<
+				std::setw(10) << stats.percentile(0.5) << std::setw(10) << stats.percentile(0.99) << std::setw(10) << stats.max() << std::endl;
+		}
+		return out.str();
+	}
+
+private:
+	mutable std::mutex statsMutex;
+	std::atomic<bool> tracing{false};
+	std::chrono::steady_clock::time_point traceStart;
+	std::mutex traceMutex;
+	std::vector<TraceEvent> events;
+};
+
+// times the enclosing scope into one stage of the profiler, and into the
+// trace while one runs. Does nothing without a profiler.
+struct ScopedTimer
+{
+	ScopedTimer(Profiler* profiler, int stage) : profiler(profiler), stage(stage) {
+		if (profiler)
+			this->start = std::chrono::steady_clock::now();
+	}
+
+	~ScopedTimer() {
+		if (!this->profiler)
+			return;
+		auto end = std::chrono::steady_clock::now();
+		this->profiler->record(this->stage, std::chrono::duration<double, std::milli>(end - this->start).count());
+		if (this->profiler->isTracing())
+			this->profiler->trace(Profiler::stageName(this->stage), this->start, end);
+	}
+
+	ScopedTimer(const ScopedTimer&) = delete;
+	ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+private:
+	Profiler* profiler;
+	int stage;
+	std::chrono::steady_clock::time_point start;
+};
+
+// puts the enclosing scope into the trace under name, a string literal.
+// Only costs a check when no trace runs; safe on worker threads.
+struct TraceScope
+{
+	TraceScope(Profiler* profiler, const char* name) : profiler(profiler && profiler->isTracing() ? profiler : nullptr), name(name) {
+		if (this->profiler)
+			this->start = std::chrono::steady_clock::now();
+	}
+
+	~TraceScope() {
+		if (this->profiler)
+			this->profiler->trace(this->name, this->start, std::chrono::steady_clock::now());
+	}
+
+	TraceScope(const TraceScope&) = delete;
+	TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+	Profiler* profiler;
+	const char* name;
+	std::chrono::steady_clock::time_point start;
+};
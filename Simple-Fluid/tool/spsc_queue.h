@@ -0,0 +1,35 @@
+#pragma once
+#include <atomic>
+
+// Bounded lock-free queue for exactly one producer and one consumer thread.
+// Holds up to Capacity - 1 items; push fails instead of waiting when full.
+template <typename T, int Capacity>
+struct SpscQueue
+{
+	// producer side
+	bool push(const T& item) {
+		auto tail = this->tail.load(std::memory_order_relaxed);
+		auto next = (tail + 1) % Capacity;
+		if (next == this->head.load(std::memory_order_acquire))
+			return false;
+		this->items[tail] = item;
+		this->tail.store(next, std::memory_order_release);
+		return true;
+	}
+
+	// consumer side
+	bool pop(T& item) {
+		auto head = this->head.load(std::memory_order_relaxed);
+		if (head == this->tail.load(std::memory_order_acquire))
+			return false;
+		item = this->items[head];
+		this->head.store((head + 1) % Capacity, std::memory_order_release);
+		return true;
+	}
+
+private:
+	// on their own cache lines so the two threads do not share one
+	alignas(64) std::atomic<int> head{0};
+	alignas(64) std::atomic<int> tail{0};
+	T items[Capacity];
+};
@@ -0,0 +1,105 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads for the per-step grid loops.
+// The calling thread works as thread 0, so a pool of size 1 spawns nothing
+// and parallelFor degenerates to a plain call.
+struct ThreadPool
+{
+	ThreadPool(int numThreads = 0) {
+		if (numThreads <= 0)
+			numThreads = std::max(1, (int)std::thread::hardware_concurrency());
+		this->numThreads = numThreads;
+		for (auto t = 1; t < numThreads; t++)
+			this->workers.emplace_back([this, t]() { this->workerLoop(t); });
+	}
+
+	~ThreadPool() {
+		{
+			std::lock_guard<std::mutex> lock(this->mutex);
+			this->quit = true;
+		}
+		this->wake.notify_all();
+		for (auto& w : this->workers)
+			w.join();
+	}
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	int size() const { return this->numThreads; }
+
+	// static chunking: thread t gets the t-th contiguous slice of [begin, end).
+	// fn(lo, hi, t) is not called for empty slices. Blocks until all slices are done.
+	void parallelFor(int begin, int end, const std::function<void(int, int, int)>& fn) {
+		if (this->numThreads == 1 || end - begin < 2) {
+			if (begin < end)
+				fn(begin, end, 0);
+			return;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(this->mutex);
+			this->job = &fn;
+			this->jobBegin = begin;
+			this->jobEnd = end;
+			this->pending.store(this->numThreads - 1);
+			this->generation.fetch_add(1);
+		}
+		this->wake.notify_all();
+
+		this->runSlice(0);
+
+		std::unique_lock<std::mutex> lock(this->mutex);
+		this->done.wait(lock, [this]() { return this->pending.load() == 0; });
+		this->job = nullptr;
+	}
+
+private:
+	int numThreads;
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable done;
+	std::atomic<unsigned> generation{0};
+	std::atomic<int> pending{0};
+	bool quit{false};
+
+	const std::function<void(int, int, int)>* job{nullptr};
+	int jobBegin{0};
+	int jobEnd{0};
+
+	void runSlice(int t) {
+		auto count = this->jobEnd - this->jobBegin;
+		auto lo = this->jobBegin + (int)((long long)count * t / this->numThreads);
+		auto hi = this->jobBegin + (int)((long long)count * (t + 1) / this->numThreads);
+		if (lo < hi)
+			(*this->job)(lo, hi, t);
+	}
+
+	void workerLoop(int t) {
+		auto seen = 0u;
+		for (;;) {
+			{
+				std::unique_lock<std::mutex> lock(this->mutex);
+				this->wake.wait(lock, [this, seen]() { return this->quit || this->generation.load() != seen; });
+				if (this->quit)
+					return;
+				seen = this->generation.load();
+			}
+
+			this->runSlice(t);
+
+			if (this->pending.fetch_sub(1) == 1) {
+				std::lock_guard<std::mutex> lock(this->mutex);
+				this->done.notify_one();
+			}
+		}
+	}
+};
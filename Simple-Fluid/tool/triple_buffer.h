@@ -0,0 +1,36 @@
+#pragma once
+#include <atomic>
+
+// Lock-free hand-over of whole values from one writer thread to one reader.
+// The writer fills back() and publishes it; the reader picks up the newest
+// published value with update() and reads front() for as long as it likes.
+// Neither side ever waits: there is always a third slot to write into.
+template <typename T>
+struct TripleBuffer
+{
+	// writer side
+	T& back() { return this->slots[this->backIndex]; }
+
+	void publish() {
+		this->backIndex = this->shared.exchange(this->backIndex | FRESH, std::memory_order_acq_rel) & INDEX;
+	}
+
+	// reader side, true if front() changed
+	bool update() {
+		if (!(this->shared.load(std::memory_order_acquire) & FRESH))
+			return false;
+		this->frontIndex = this->shared.exchange(this->frontIndex, std::memory_order_acq_rel) & INDEX;
+		return true;
+	}
+
+	const T& front() const { return this->slots[this->frontIndex]; }
+
+private:
+	static const int INDEX = 3;
+	static const int FRESH = 4;	// set while the shared slot holds a value the reader has not seen
+
+	T slots[3];
+	std::atomic<int> shared{1};
+	int backIndex{0};
+	int frontIndex{2};
+};